@@ -1,3 +1,6 @@
+#ifndef BLINK_H
+#define BLINK_H
+
 #include <avr/io.h>
 #include <util/delay.h>
 
@@ -13,4 +16,6 @@
         _delay_ms(__VA_ARGS__);      \
     }                                \
     return 0;                        \
-}
\ No newline at end of file
+}
+
+#endif // BLINK_H
\ No newline at end of file
@@ -0,0 +1,554 @@
+#ifndef BUILD_H
+#define BUILD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libc/dce.h"
+
+#define BUILD_CACHE_DIR     ".cache"
+#define BUILD_PCH_DIR       BUILD_CACHE_DIR "/pch"
+#define BUILD_PCH_HEADER    "blink.h"
+#define BUILD_CMD_LENGTH    1024
+#define BUILD_MAX_STAGES    16  // project mode records 9: PCH, COMPILE, LINK, OBJCOPY, EEPCOPY, CONNECT, FUSES, FLASH, EEPROM
+#define BUILD_HISTORY       16
+#define BUILD_LOG_ENV       "M_BUILD_LOG"   // path of an optional .csv or .json run log
+#define BUILD_OBJ_DIR       BUILD_CACHE_DIR "/obj"
+#define BUILD_MAX_SOURCES   256
+
+typedef struct build_t build_t;
+
+typedef struct {
+    const char *name;
+    int code;
+    double ms;              // wall clock, including process spawn
+} build_stage_t;
+
+typedef struct {
+    time_t started;
+    int count;
+    double total_ms;
+    build_stage_t stages[BUILD_MAX_STAGES];
+} build_run_t;
+
+struct build_t {
+    build_run_t history[BUILD_HISTORY];
+    int runs;
+
+    int (*precompile)   (const char *compiler, const char *mcu, unsigned long f_cpu, const char *cflags, char *flags, size_t size);
+    int (*mkdirs)       (const char *path);
+    double (*now)       (void);
+    void (*begin)       (void);
+    int (*run)          (const char *name, const char *cmd);
+    void (*record)      (const char *name, int code, double ms);
+    void (*end)         (void);
+    build_run_t *(*last)(int back);
+    int (*dominant)     (const build_run_t *run);
+    double (*average)   (const char *name);
+    int (*cores)        (void);
+    int (*parallel)     (char (*cmds)[BUILD_CMD_LENGTH], int count, int *codes, double *ms);
+    int (*project)      (const char *manifest, const char *compiler, const char *mcu, unsigned long f_cpu, const char *cflags, const char *pch, const char *output);
+};
+
+static int build_precompile(const char *compiler, const char *mcu, unsigned long f_cpu, const char *cflags, char *flags, size_t size);
+static int build_mkdirs(const char *path);
+static double build_now(void);
+static void build_begin(void);
+static int build_run(const char *name, const char *cmd);
+static void build_record(const char *name, int code, double ms);
+static void build_end(void);
+static build_run_t *build_last(int back);
+static int build_dominant(const build_run_t *run);
+static double build_average(const char *name);
+static int build_cores(void);
+static int build_parallel(char (*cmds)[BUILD_CMD_LENGTH], int count, int *codes, double *ms);
+static int build_project(const char *manifest, const char *compiler, const char *mcu, unsigned long f_cpu, const char *cflags, const char *pch, const char *output);
+
+static build_t build = {
+    .runs = 0,
+    .precompile = build_precompile,
+    .mkdirs = build_mkdirs,
+    .now = build_now,
+    .begin = build_begin,
+    .run = build_run,
+    .record = build_record,
+    .end = build_end,
+    .last = build_last,
+    .dominant = build_dominant,
+    .average = build_average,
+    .cores = build_cores,
+    .parallel = build_parallel,
+    .project = build_project
+};
+
+// IMPLEMENTATIONS
+
+static uint32_t build_hash(const char *str) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int build_mkdirs(const char *path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(tmp, 0755);
+            *p = '/';
+        }
+    }
+    return mkdir(tmp, 0755) == 0 || access(tmp, F_OK) == 0 ? 0 : -1;
+}
+
+// Identifies the toolchain and target a .gch or object was produced for, so a
+// replaced compiler or a new MCU, clock or flag set invalidates it
+static void build_stamp(const char *compiler, const char *mcu, unsigned long f_cpu, const char *cflags, char *stamp, size_t size) {
+    struct stat st;
+    if (stat(compiler, &st) != 0) {
+        memset(&st, 0, sizeof(st));
+    }
+    snprintf(stamp, size, "%s %lld %lld %s %lu %s\n", compiler, (long long)st.st_size, (long long)st.st_mtime, mcu, f_cpu, cflags);
+}
+
+// Compares modification times to the nanosecond. A file stamped in the same
+// tick as the build output counts as changed: on coarse filesystems an edit
+// saved right after a compile would otherwise go unnoticed.
+static int build_changed_since(const struct stat *file, const struct stat *built) {
+    if (file->st_mtim.tv_sec != built->st_mtim.tv_sec) {
+        return file->st_mtim.tv_sec > built->st_mtim.tv_sec;
+    }
+    return file->st_mtim.tv_nsec >= built->st_mtim.tv_nsec;
+}
+
+// Walks the make-style dependency list gcc wrote next to the .gch or object and
+// checks that none of the headers it was built from changed afterwards
+static int build_deps_fresh(const char *deps, const struct stat *built) {
+    FILE *fp = fopen(deps, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    char token[PATH_MAX];
+    size_t len = 0;
+    int fresh = 1;
+    int c;
+    do {
+        c = fgetc(fp);
+        if (c == '\\') {
+            int next = fgetc(fp);
+            if (next == ' ' && len < sizeof(token) - 1) {
+                token[len++] = ' ';  // Escaped space inside a path
+                continue;
+            }
+            if (next == '\n' || next == '\r') {
+                c = ' ';
+            } else {
+                if (len < sizeof(token) - 1) token[len++] = '\\';
+                c = next;
+            }
+        }
+        if (c == EOF || c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            token[len] = '\0';
+            if (len > 0 && token[len - 1] != ':') {
+                struct stat st;
+                if (stat(token, &st) != 0 || build_changed_since(&st, built)) {
+                    fresh = 0;
+                }
+            }
+            len = 0;
+        } else if (len < sizeof(token) - 1) {
+            token[len++] = (char)c;
+        }
+    } while (c != EOF && fresh);
+
+    fclose(fp);
+    return fresh;
+}
+
+// Builds (or reuses) a precompiled prologue for one MCU/F_CPU/flag combination and
+// writes the compiler flags that pull it in to `flags`. On any failure `flags` is
+// left empty so the caller simply compiles without the PCH.
+static int build_precompile(const char *compiler, const char *mcu, unsigned long f_cpu, const char *cflags, char *flags, size_t size) {
+    flags[0] = '\0';
+
+    char header[PATH_MAX];
+    if (realpath(BUILD_PCH_HEADER, header) == NULL) {
+        return -1;
+    }
+
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/%s-%lu-%08x", BUILD_PCH_DIR, mcu, f_cpu, build_hash(cflags));
+    if (build.mkdirs(dir) != 0) {
+        return -1;
+    }
+
+    char prologue[PATH_MAX + 16], gch[PATH_MAX + 16], deps[PATH_MAX + 16], stamp_path[PATH_MAX + 16];
+    snprintf(prologue, sizeof(prologue), "%s/prologue.h", dir);
+    snprintf(gch, sizeof(gch), "%s/prologue.h.gch", dir);
+    snprintf(deps, sizeof(deps), "%s/prologue.d", dir);
+    snprintf(stamp_path, sizeof(stamp_path), "%s/prologue.stamp", dir);
+
+    char stamp[PATH_MAX + 256];
+    build_stamp(compiler, mcu, f_cpu, cflags, stamp, sizeof(stamp));
+
+    // Reuse the cached .gch while the toolchain stamp matches and no header is newer
+    struct stat st;
+    int fresh = 0;
+    if (stat(gch, &st) == 0) {
+        char previous[sizeof(stamp)] = {0};
+        FILE *fp = fopen(stamp_path, "r");
+        if (fp) {
+            size_t n = fread(previous, 1, sizeof(previous) - 1, fp);
+            previous[n] = '\0';
+            fclose(fp);
+        }
+        fresh = strcmp(previous, stamp) == 0 && build_deps_fresh(deps, &st);
+    }
+
+    if (!fresh) {
+        FILE *fp = fopen(prologue, "w");
+        if (fp == NULL) {
+            return -1;
+        }
+        fprintf(fp, "#include \"%s\"\n", header);
+        fclose(fp);
+
+        char cmd[BUILD_CMD_LENGTH];
+        int length = snprintf(cmd, sizeof(cmd), "\"%s\" %s -mmcu=%s -DF_CPU=%luUL -x c-header -MD -MF \"%s\" -o \"%s\" \"%s\" > %s 2>&1",
+                              compiler, cflags, mcu, f_cpu, deps, gch, prologue, IsWindows() ? "NUL" : "/dev/null");
+        // A truncated command line would run something other than intended
+        if (length >= (int)sizeof(cmd) || system(cmd) != 0) {
+            remove(gch);
+            return -1;
+        }
+
+        fp = fopen(stamp_path, "w");
+        if (fp) {
+            fputs(stamp, fp);
+            fclose(fp);
+        }
+    }
+
+    snprintf(flags, size, "-include \"%s\" -Winvalid-pch", prologue);
+    return 0;
+}
+
+static double build_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static build_run_t *build_last(int back) {
+    if (back < 0 || back >= build.runs || back >= BUILD_HISTORY) {
+        return NULL;
+    }
+    return &build.history[(build.runs - 1 - back) % BUILD_HISTORY];
+}
+
+static void build_begin(void) {
+    build_run_t *run = &build.history[build.runs % BUILD_HISTORY];
+    memset(run, 0, sizeof(*run));
+    run->started = time(NULL);
+    build.runs++;
+}
+
+// BUILD_MAX_STAGES leaves room for every stage the pipeline records. Should a run
+// outgrow it anyway, further stages still count toward the total but get no row;
+// a timing table is never worth ending the editor session over.
+static void build_record(const char *name, int code, double ms) {
+    build_run_t *run = build.last(0);
+    if (run == NULL) {
+        return;
+    }
+    run->total_ms += ms;
+    if (run->count < BUILD_MAX_STAGES) {
+        run->stages[run->count++] = (build_stage_t){ name, code, ms };
+    }
+}
+
+// Runs one pipeline stage through the shell and records its wall-clock time
+static int build_run(const char *name, const char *cmd) {
+    double start = build.now();
+    int code = system(cmd);
+    build.record(name, code, build.now() - start);
+    return code;
+}
+
+static int build_dominant(const build_run_t *run) {
+    int dominant = -1;
+    for (int i = 0; i < run->count; i++) {
+        if (dominant < 0 || run->stages[i].ms > run->stages[dominant].ms) {
+            dominant = i;
+        }
+    }
+    return dominant;
+}
+
+// Mean duration of a stage across the in-memory history, or -1 if it never ran
+static double build_average(const char *name) {
+    double sum = 0;
+    int n = 0;
+    for (int back = 0; build.last(back) != NULL; back++) {
+        build_run_t *run = build.last(back);
+        for (int i = 0; i < run->count; i++) {
+            if (strcmp(run->stages[i].name, name) == 0) {
+                sum += run->stages[i].ms;
+                n++;
+            }
+        }
+    }
+    return n ? sum / n : -1;
+}
+
+// Appends the finished run to $M_BUILD_LOG: one JSON object per line for *.json, CSV otherwise
+static void build_end(void) {
+    build_run_t *run = build.last(0);
+    const char *path = getenv(BUILD_LOG_ENV);
+    if (run == NULL || path == NULL || *path == '\0') {
+        return;
+    }
+
+    size_t len = strlen(path);
+    int json = len > 5 && strcmp(path + len - 5, ".json") == 0;
+    int fresh = access(path, F_OK) != 0;
+
+    FILE *fp = fopen(path, "a");
+    if (fp == NULL) {
+        return;
+    }
+    if (json) {
+        fprintf(fp, "{\"started\":%lld,\"total_ms\":%.1f,\"stages\":[", (long long)run->started, run->total_ms);
+        for (int i = 0; i < run->count; i++) {
+            fprintf(fp, "%s{\"name\":\"%s\",\"code\":%d,\"ms\":%.1f}", i ? "," : "",
+                    run->stages[i].name, run->stages[i].code, run->stages[i].ms);
+        }
+        fprintf(fp, "]}\n");
+    } else {
+        if (fresh) {
+            fprintf(fp, "started,stage,code,ms\n");
+        }
+        for (int i = 0; i < run->count; i++) {
+            fprintf(fp, "%lld,%s,%d,%.1f\n", (long long)run->started,
+                    run->stages[i].name, run->stages[i].code, run->stages[i].ms);
+        }
+    }
+    fclose(fp);
+}
+
+static int build_cores(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+typedef struct {
+    char (*cmds)[BUILD_CMD_LENGTH];
+    int count;
+    int next;
+    int *codes;
+    double *ms;
+    pthread_mutex_t lock;
+} build_queue_t;
+
+static void *build_worker(void *arg) {
+    build_queue_t *queue = arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int i = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (i >= queue->count) {
+            break;
+        }
+        double start = build.now();
+        queue->codes[i] = system(queue->cmds[i]);
+        if (queue->ms) {
+            queue->ms[i] = build.now() - start;
+        }
+    }
+    return NULL;
+}
+
+// Runs independent commands on one worker per core; returns how many failed
+static int build_parallel(char (*cmds)[BUILD_CMD_LENGTH], int count, int *codes, double *ms) {
+    build_queue_t queue = { .cmds = cmds, .count = count, .next = 0, .codes = codes, .ms = ms };
+    pthread_mutex_init(&queue.lock, NULL);
+
+    int workers = build.cores();
+    if (workers > count) workers = count;
+    pthread_t threads[workers > 0 ? workers : 1];
+    int started = 0;
+    for (; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, build_worker, &queue) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        build_worker(&queue);  // No threads available, drain the queue inline
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        if (codes[i] != 0) failed++;
+    }
+    return failed;
+}
+
+// Flattens a source path into one object name under BUILD_OBJ_DIR. Separators are
+// escaped rather than replaced ('_' itself doubles), so "a/b.c" and "a_b.c" differ.
+static void build_object_path(const char *source, char *object, size_t size) {
+    char name[2 * PATH_MAX];
+    size_t length = 0;
+    for (const char *p = source; *p && length < sizeof(name) - 2; p++) {
+        const char *escape = *p == '_' ? "__" : *p == '/' ? "_s" : *p == '\\' ? "_b" : *p == ':' ? "_c" : NULL;
+        if (escape) {
+            name[length++] = escape[0];
+            name[length++] = escape[1];
+        } else {
+            name[length++] = *p;
+        }
+    }
+    name[length] = '\0';
+    snprintf(object, size, "%s/%s.o", BUILD_OBJ_DIR, name);
+}
+
+// An object is current when it is newer than its source and every header in its .d file
+static int build_object_fresh(const char *source, const char *object) {
+    struct stat obj, src;
+    if (stat(object, &obj) != 0 || stat(source, &src) != 0 || build_changed_since(&src, &obj)) {
+        return 0;
+    }
+    char deps[2 * PATH_MAX + 16];
+    snprintf(deps, sizeof(deps), "%.*s.d", (int)(strlen(object) - 2), object);
+    return build_deps_fresh(deps, &obj);
+}
+
+// Builds a multi-file firmware listed in a manifest (one C/asm source per line,
+// '#' starts a comment). Only objects whose source or -MMD headers changed are
+// recompiled, in parallel, before a single link into `output`. The sketch itself
+// (blink.c) additionally gets the precompiled prologue flags in `pch`.
+static int build_project(const char *manifest, const char *compiler, const char *mcu, unsigned long f_cpu, const char *cflags, const char *pch, const char *output) {
+    FILE *fp = fopen(manifest, "r");
+    if (fp == NULL) {
+        build.record("MANIFEST", -1, 0);
+        return -1;
+    }
+
+    // A source left out would fail the link with confusing undefined symbols, or
+    // not fail it at all, so a manifest with more than fits fails as a whole and
+    // shows up as a failed MANIFEST stage in the results table
+    static char sources[BUILD_MAX_SOURCES][PATH_MAX];
+    int count = 0;
+    int overflow = 0;
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), fp)) {
+        char *start = line;
+        while (*start == ' ' || *start == '\t') start++;
+        char *end = start + strcspn(start, "#\r\n");
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+        *end = '\0';
+        if (*start && count == BUILD_MAX_SOURCES) {
+            overflow = 1;
+        } else if (*start) {
+            snprintf(sources[count++], PATH_MAX, "%s", start);
+        }
+    }
+    fclose(fp);
+    if (count == 0 || overflow) {
+        build.record("MANIFEST", -1, 0);
+        return -1;
+    }
+    if (build.mkdirs(BUILD_OBJ_DIR) != 0) {
+        build.record("COMPILE", -1, 0);
+        return -1;
+    }
+
+    // Changing the compiler, MCU, F_CPU or flags invalidates every object
+    char stamp[PATH_MAX + 256], previous[sizeof(stamp)] = {0};
+    char stamp_path[] = BUILD_OBJ_DIR "/stamp";
+    build_stamp(compiler, mcu, f_cpu, cflags, stamp, sizeof(stamp));
+    fp = fopen(stamp_path, "r");
+    if (fp) {
+        size_t n = fread(previous, 1, sizeof(previous) - 1, fp);
+        previous[n] = '\0';
+        fclose(fp);
+    }
+    int rebuild_all = strcmp(previous, stamp) != 0;
+
+    char (*cmds)[BUILD_CMD_LENGTH] = malloc(count * sizeof(*cmds));
+    int *codes = malloc(count * sizeof(int));
+    size_t link_length = BUILD_CMD_LENGTH;
+    for (int i = 0; i < count; i++) {
+        link_length += 2 * strlen(sources[i]) + sizeof(BUILD_OBJ_DIR) + 8;
+    }
+    char *link = malloc(link_length);
+    if (cmds == NULL || codes == NULL || link == NULL) {
+        free(cmds);
+        free(codes);
+        free(link);
+        return -1;
+    }
+
+    int offset = snprintf(link, link_length, "\"%s\" %s -mmcu=%s -o \"%s\"", compiler, cflags, mcu, output);
+    int stale = 0;
+    int truncated = 0;
+    for (int i = 0; i < count; i++) {
+        char object[2 * PATH_MAX + 16], deps[2 * PATH_MAX + 16];
+        build_object_path(sources[i], object, sizeof(object));
+        snprintf(deps, sizeof(deps), "%.*s.d", (int)(strlen(object) - 2), object);
+        offset += snprintf(link + offset, link_length - offset, " \"%s\"", object);
+
+        if (!rebuild_all && build_object_fresh(sources[i], object)) {
+            continue;
+        }
+        const char *base = strrchr(sources[i], '/');
+        int is_sketch = strcmp(base ? base + 1 : sources[i], "blink.c") == 0;
+        int length = snprintf(cmds[stale++], BUILD_CMD_LENGTH, "\"%s\" %s %s -mmcu=%s -DF_CPU=%luUL -MMD -MP -MF \"%s\" -c -o \"%s\" \"%s\" > %s 2>&1",
+                              compiler, cflags, is_sketch && pch ? pch : "", mcu, f_cpu, deps, object, sources[i], IsWindows() ? "NUL" : "/dev/null");
+        if (length >= BUILD_CMD_LENGTH) {
+            truncated = 1;  // would compile something other than intended
+        }
+    }
+
+    int code = truncated ? -1 : 0;
+    double start = build.now();
+    if (stale > 0 && !truncated) {
+        code = build.parallel(cmds, stale, codes, NULL);
+    }
+    build.record("COMPILE", code, build.now() - start);
+
+    if (code == 0) {
+        fp = fopen(stamp_path, "w");
+        if (fp) {
+            fputs(stamp, fp);
+            fclose(fp);
+        }
+        struct stat st;
+        if (stale > 0 || stat(output, &st) != 0) {
+            snprintf(link + offset, link_length - offset, " > %s 2>&1", IsWindows() ? "NUL" : "/dev/null");
+            code = build.run("LINK", link);
+        }
+    }
+
+    free(cmds);
+    free(codes);
+    free(link);
+    return code;
+}
+
+#endif // BUILD_H
@@ -0,0 +1,524 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "libc/dce.h"
+
+#define DEVICE_CONF_ENV     "M_AVRDUDE_CONF"    // overrides the avrdude.conf shipped in resource/
+#define DEVICE_TABLE_PATH   ".cache/devices.bin"
+#define DEVICE_MAGIC        0x5645444d          // "MDEV"
+#define DEVICE_VERSION      1
+#define DEVICE_MAX_PARTS    512
+#define DEVICE_MAX_FUSES    6
+#define DEVICE_ID_LENGTH    24
+#define DEVICE_DESC_LENGTH  32
+#define DEVICE_FUSE_LENGTH  8
+#define DEVICE_NO_ENTRY     0xFFFF
+
+typedef struct device_db_t device_db_t;
+
+// One fuse byte and the ISP instructions that reach it. The data byte goes in
+// (write) or comes back in (read) the last instruction byte.
+typedef struct {
+    char name[DEVICE_FUSE_LENGTH];      // "lfuse", "hfuse", "efuse", "fuse", ...
+    uint8_t read[4];
+    uint8_t write[4];
+    uint8_t initval;                    // factory default
+    uint8_t bitmask;                    // implemented bits
+} device_fuse_t;
+
+typedef struct {
+    char id[DEVICE_ID_LENGTH];          // avrdude part id, e.g. "t85"
+    char desc[DEVICE_DESC_LENGTH];      // e.g. "ATtiny85"
+    uint8_t signature[3];
+    uint8_t stk500_devcode;
+    uint32_t flash_size;
+    uint16_t flash_page;                // bytes
+    uint16_t eeprom_size;
+    uint16_t eeprom_page;
+    uint16_t chip_erase_delay;          // us
+    uint8_t fuse_count;
+    device_fuse_t fuses[DEVICE_MAX_FUSES];
+} device_t;
+
+// Layout of the generated table: this header, `count` devices, then two
+// open-addressed hash indexes of device numbers (signature, then id/desc)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t count;
+    uint32_t sig_slots;
+    uint32_t name_slots;
+    int64_t source_mtime;
+    int64_t source_size;
+} device_header_t;
+
+struct device_db_t {
+    const device_t *parts;
+    int count;
+
+    int (*open)                     (const char *conf);
+    int (*generate)                 (const char *conf, const char *table);
+    const device_t *(*by_signature) (const uint8_t signature[3]);
+    const device_t *(*by_name)      (const char *name);
+    const device_fuse_t *(*fuse)    (const device_t *part, const char *name);
+    const char *(*conf_path)        (void);
+};
+
+static int device_open(const char *conf);
+static int device_generate(const char *conf, const char *table);
+static const device_t *device_by_signature(const uint8_t signature[3]);
+static const device_t *device_by_name(const char *name);
+static const device_fuse_t *device_fuse(const device_t *part, const char *name);
+static const char *device_conf_path(void);
+
+static device_db_t device = {
+    .parts = NULL,
+    .count = 0,
+    .open = device_open,
+    .generate = device_generate,
+    .by_signature = device_by_signature,
+    .by_name = device_by_name,
+    .fuse = device_fuse,
+    .conf_path = device_conf_path
+};
+
+static device_header_t device_header;
+static const uint16_t *device_sig_index;
+static const uint16_t *device_name_index;
+static unsigned char *device_table;
+
+// IMPLEMENTATIONS
+
+static uint32_t device_hash_bytes(const uint8_t *data, size_t length, int fold) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= fold ? (uint8_t)tolower(data[i]) : data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t device_hash_name(const char *name) {
+    return device_hash_bytes((const uint8_t *)name, strlen(name), 1);
+}
+
+static uint32_t device_slots_for(int keys) {
+    uint32_t slots = 16;
+    while (slots < (uint32_t)keys * 2) slots <<= 1;
+    return slots;
+}
+
+static const char *device_conf_path(void) {
+    const char *env = getenv(DEVICE_CONF_ENV);
+    if (env) return env;
+    if (IsLinux()) return "./resource/linux/avrdude/avrdude.conf";
+    if (IsWindows()) return "./resource/windows/avrdude/avrdude.conf";
+    if (IsXnu()) return "./resource/mac/avrdude/avrdude.conf";
+    return NULL;
+}
+
+// Tokens are words, quoted strings (without quotes) and the punctuation = ; ,
+typedef struct {
+    const char *text;
+    size_t length;
+    int quoted;
+} device_token_t;
+
+static int device_next_token(const char **cursor, const char *end, device_token_t *token) {
+    const char *p = *cursor;
+    for (;;) {
+        while (p < end && isspace((unsigned char)*p)) p++;
+        if (p < end && *p == '#') {
+            while (p < end && *p != '\n') p++;
+            continue;
+        }
+        break;
+    }
+    if (p >= end) {
+        *cursor = p;
+        return 0;
+    }
+
+    token->quoted = 0;
+    if (*p == '"') {
+        token->text = ++p;
+        while (p < end && *p != '"') p++;
+        token->length = p - token->text;
+        token->quoted = 1;
+        if (p < end) p++;
+    } else if (*p == '=' || *p == ';' || *p == ',') {
+        token->text = p++;
+        token->length = 1;
+    } else {
+        token->text = p;
+        while (p < end && !isspace((unsigned char)*p) && *p != '=' && *p != ';' && *p != ',' && *p != '"' && *p != '#') p++;
+        token->length = p - token->text;
+    }
+    *cursor = p;
+    return 1;
+}
+
+static int device_token_is(const device_token_t *token, const char *word) {
+    return !token->quoted && token->length == strlen(word) && memcmp(token->text, word, token->length) == 0;
+}
+
+static void device_token_copy(const device_token_t *token, char *out, size_t size) {
+    size_t length = token->length < size - 1 ? token->length : size - 1;
+    memcpy(out, token->text, length);
+    out[length] = 0;
+}
+
+static unsigned long device_token_number(const device_token_t *token) {
+    char buffer[32];
+    device_token_copy(token, buffer, sizeof(buffer));
+    return strtoul(buffer, NULL, 0);
+}
+
+// "1010.1100--1010.0000--xxxx.xxxx--iiii.iiii" -> AC A0 00 00; only the fixed
+// 1 bits are kept, address/data/don't-care bits are left for the caller to fill
+static int device_parse_opcode(const device_token_t *token, uint8_t opcode[4]) {
+    int bit = 0;
+    memset(opcode, 0, 4);
+    for (size_t i = 0; i < token->length && bit < 32; i++) {
+        char c = token->text[i];
+        if (!strchr("01xaio", c)) continue;
+        if (c == '1') opcode[bit / 8] |= 0x80 >> (bit % 8);
+        bit++;
+    }
+    return bit == 32;
+}
+
+static device_fuse_t *device_fuse_slot(device_t *part, const char *name, int create) {
+    for (int i = 0; i < part->fuse_count; i++) {
+        if (strcmp(part->fuses[i].name, name) == 0) return &part->fuses[i];
+    }
+    if (!create || part->fuse_count >= DEVICE_MAX_FUSES) return NULL;
+    device_fuse_t *fuse = &part->fuses[part->fuse_count++];
+    memset(fuse, 0, sizeof(*fuse));
+    snprintf(fuse->name, sizeof(fuse->name), "%s", name);
+    fuse->initval = 0xFF;
+    fuse->bitmask = 0xFF;
+    return fuse;
+}
+
+static void device_drop_fuse(device_t *part, const char *name) {
+    for (int i = 0; i < part->fuse_count; i++) {
+        if (strcmp(part->fuses[i].name, name) == 0) {
+            memmove(&part->fuses[i], &part->fuses[i + 1], (part->fuse_count - i - 1) * sizeof(device_fuse_t));
+            part->fuse_count--;
+            return;
+        }
+    }
+}
+
+// Applies one `key = value ...;` statement, inside `memory` when one is open
+static void device_apply(device_t *part, const char *memory, const device_token_t *tokens, int count) {
+    if (count < 3 || !device_token_is(&tokens[1], "=")) return;
+    const device_token_t *key = &tokens[0];
+    const device_token_t *value = &tokens[2];
+
+    if (memory[0] == 0) {
+        if (device_token_is(key, "id")) {
+            device_token_copy(value, part->id, sizeof(part->id));
+        } else if (device_token_is(key, "desc")) {
+            device_token_copy(value, part->desc, sizeof(part->desc));
+        } else if (device_token_is(key, "stk500_devcode")) {
+            part->stk500_devcode = device_token_number(value);
+        } else if (device_token_is(key, "chip_erase_delay")) {
+            part->chip_erase_delay = device_token_number(value);
+        } else if (device_token_is(key, "signature") && count >= 5) {
+            for (int i = 0; i < 3; i++) part->signature[i] = device_token_number(&tokens[2 + i]);
+        }
+        return;
+    }
+
+    int is_size = device_token_is(key, "size");
+    int is_page = device_token_is(key, "page_size");
+    if (strcmp(memory, "flash") == 0) {
+        if (is_size) part->flash_size = device_token_number(value);
+        if (is_page) part->flash_page = device_token_number(value);
+    } else if (strcmp(memory, "eeprom") == 0) {
+        if (is_size) part->eeprom_size = device_token_number(value);
+        if (is_page) part->eeprom_page = device_token_number(value);
+    } else if (strstr(memory, "fuse") != NULL) {
+        device_fuse_t *fuse = device_fuse_slot(part, memory, 0);
+        if (fuse == NULL) return;
+        if (device_token_is(key, "read")) {
+            device_parse_opcode(value, fuse->read);
+        } else if (device_token_is(key, "write")) {
+            device_parse_opcode(value, fuse->write);
+        } else if (device_token_is(key, "initval")) {
+            fuse->initval = device_token_number(value);
+        } else if (device_token_is(key, "bitmask")) {
+            fuse->bitmask = device_token_number(value);
+        }
+    }
+}
+
+// Parses avrdude.conf into parts[], resolving `part parent "<id>"` by copying the
+// parent before the child's own statements (and memory blocks) override it
+static int device_parse(const char *text, size_t length, device_t *parts, int max_parts) {
+    const char *cursor = text;
+    const char *end = text + length;
+    device_token_t tokens[64];
+    int count = 0;
+    int parts_found = 0;
+    int depth = 0;              // 0 top level, 1 in a block, 2 in a memory block
+    int in_part = 0;
+    char memory[DEVICE_FUSE_LENGTH + 8] = "";
+    device_t *part = NULL;
+    device_token_t token;
+
+    while (device_next_token(&cursor, end, &token)) {
+        if (!device_token_is(&token, ";")) {
+            if (count < (int)(sizeof(tokens) / sizeof(tokens[0]))) tokens[count++] = token;
+            continue;
+        }
+
+        if (count == 0) {
+            // An empty statement closes the innermost block
+            if (depth == 2) {
+                depth = 1;
+                memory[0] = 0;
+            } else if (depth == 1) {
+                if (in_part && part != NULL && parts_found < max_parts) parts_found++;
+                depth = 0;
+                in_part = 0;
+                part = NULL;
+            }
+            continue;
+        }
+
+        if (depth == 0 && (device_token_is(&tokens[0], "part") || device_token_is(&tokens[0], "programmer") ||
+                           device_token_is(&tokens[0], "serialadapter"))) {
+            // The block header has no ';' of its own, so its first statement arrives attached
+            depth = 1;
+            in_part = device_token_is(&tokens[0], "part");
+            int skip = 1;
+            part = NULL;
+            if (in_part && parts_found < max_parts) {
+                part = &parts[parts_found];
+                memset(part, 0, sizeof(*part));
+                if (count >= 3 && device_token_is(&tokens[1], "parent") && tokens[2].quoted) {
+                    char parent[DEVICE_ID_LENGTH];
+                    device_token_copy(&tokens[2], parent, sizeof(parent));
+                    for (int i = parts_found - 1; i >= 0; i--) {
+                        if (strcmp(parts[i].id, parent) == 0) {
+                            *part = parts[i];
+                            break;
+                        }
+                    }
+                    skip = 3;
+                }
+            }
+            memmove(tokens, tokens + skip, (count - skip) * sizeof(device_token_t));
+            count -= skip;
+            if (count == 0) continue;
+        }
+
+        if (part != NULL && in_part) {
+            if (device_token_is(&tokens[0], "memory") && count >= 2) {
+                char name[sizeof(memory)];
+                device_token_copy(&tokens[1], name, sizeof(name));
+                if (count >= 4 && device_token_is(&tokens[2], "=") && device_token_is(&tokens[3], "NULL")) {
+                    device_drop_fuse(part, name);
+                    if (strcmp(name, "eeprom") == 0) part->eeprom_size = part->eeprom_page = 0;
+                } else {
+                    // memory "<name>" followed by its first statement
+                    snprintf(memory, sizeof(memory), "%s", name);
+                    depth = 2;
+                    if (strstr(memory, "fuse") != NULL) device_fuse_slot(part, memory, 1);
+                    if (count > 2) device_apply(part, memory, tokens + 2, count - 2);
+                }
+            } else {
+                device_apply(part, depth == 2 ? memory : "", tokens, count);
+            }
+        }
+        count = 0;
+    }
+    return parts_found;
+}
+
+static int device_generate(const char *conf, const char *table) {
+    struct stat st;
+    if (conf == NULL || stat(conf, &st) != 0) return -1;
+
+    FILE *fp = fopen(conf, "rb");
+    if (fp == NULL) return -1;
+    char *text = malloc(st.st_size);
+    if (text == NULL || fread(text, 1, st.st_size, fp) != (size_t)st.st_size) {
+        free(text);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    device_t *parsed = malloc(DEVICE_MAX_PARTS * sizeof(device_t));
+    if (parsed == NULL) {
+        free(text);
+        return -1;
+    }
+    int found = device_parse(text, st.st_size, parsed, DEVICE_MAX_PARTS);
+    free(text);
+
+    // Abstract templates (".reduced_core_tiny") and parts without a signature stay out
+    int count = 0;
+    for (int i = 0; i < found; i++) {
+        device_t *part = &parsed[i];
+        if (part->id[0] == '.' || (part->signature[0] == 0 && part->signature[1] == 0)) continue;
+        for (int f = 0; f < part->fuse_count; ) {
+            if (part->fuses[f].read[0] == 0 && part->fuses[f].write[0] == 0) {
+                device_drop_fuse(part, part->fuses[f].name);    // not reachable over ISP
+            } else {
+                f++;
+            }
+        }
+        parsed[count++] = *part;
+    }
+
+    device_header_t header = {
+        .magic = DEVICE_MAGIC,
+        .version = DEVICE_VERSION,
+        .record_size = sizeof(device_t),
+        .count = count,
+        .sig_slots = device_slots_for(count),
+        .name_slots = device_slots_for(count * 2),
+        .source_mtime = st.st_mtime,
+        .source_size = st.st_size
+    };
+    uint16_t *sig_index = malloc(header.sig_slots * sizeof(uint16_t));
+    uint16_t *name_index = malloc(header.name_slots * sizeof(uint16_t));
+    if (sig_index == NULL || name_index == NULL) {
+        free(sig_index);
+        free(name_index);
+        free(parsed);
+        return -1;
+    }
+    memset(sig_index, 0xFF, header.sig_slots * sizeof(uint16_t));
+    memset(name_index, 0xFF, header.name_slots * sizeof(uint16_t));
+
+    for (int i = 0; i < count; i++) {
+        // Several parts share a signature; the first one in the file wins, as in avrdude
+        uint32_t slot = device_hash_bytes(parsed[i].signature, 3, 0) & (header.sig_slots - 1);
+        int duplicate = 0;
+        while (sig_index[slot] != DEVICE_NO_ENTRY) {
+            if (memcmp(parsed[sig_index[slot]].signature, parsed[i].signature, 3) == 0) duplicate = 1;
+            slot = (slot + 1) & (header.sig_slots - 1);
+        }
+        if (!duplicate) sig_index[slot] = i;
+
+        const char *names[2] = {parsed[i].id, parsed[i].desc};
+        for (int n = 0; n < 2; n++) {
+            if (names[n][0] == 0) continue;
+            slot = device_hash_name(names[n]) & (header.name_slots - 1);
+            while (name_index[slot] != DEVICE_NO_ENTRY) slot = (slot + 1) & (header.name_slots - 1);
+            name_index[slot] = i;
+        }
+    }
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", table);
+    mkdir(".cache", 0755);
+    fp = fopen(tmp, "wb");
+    int ok = fp != NULL &&
+             fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(parsed, sizeof(device_t), count, fp) == (size_t)count &&
+             fwrite(sig_index, sizeof(uint16_t), header.sig_slots, fp) == header.sig_slots &&
+             fwrite(name_index, sizeof(uint16_t), header.name_slots, fp) == header.name_slots;
+    if (fp != NULL && fclose(fp) != 0) ok = 0;
+    if (ok) ok = rename(tmp, table) == 0;
+    if (!ok) remove(tmp);
+
+    free(sig_index);
+    free(name_index);
+    free(parsed);
+    return ok ? count : -1;
+}
+
+static int device_load(const char *table, const struct stat *source) {
+    FILE *fp = fopen(table, "rb");
+    if (fp == NULL) return 0;
+
+    device_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != DEVICE_MAGIC ||
+        header.version != DEVICE_VERSION || header.record_size != sizeof(device_t) ||
+        (source != NULL && (header.source_mtime != source->st_mtime || header.source_size != source->st_size))) {
+        fclose(fp);
+        return 0;
+    }
+
+    size_t body = header.count * sizeof(device_t) + (header.sig_slots + header.name_slots) * sizeof(uint16_t);
+    unsigned char *data = malloc(body);
+    if (data == NULL || fread(data, 1, body, fp) != body) {
+        free(data);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+
+    free(device_table);
+    device_table = data;
+    device_header = header;
+    device.parts = (const device_t *)data;
+    device.count = header.count;
+    device_sig_index = (const uint16_t *)(data + header.count * sizeof(device_t));
+    device_name_index = device_sig_index + header.sig_slots;
+    return 1;
+}
+
+// Loads the binary table, regenerating it first when avrdude.conf is newer or
+// different. conf may be NULL for the avrdude.conf that ships with this platform.
+// Returns the number of parts, or -1.
+static int device_open(const char *conf) {
+    if (device.parts != NULL) return device.count;
+    if (conf == NULL) conf = device_conf_path();
+
+    struct stat st;
+    int have_source = conf != NULL && stat(conf, &st) == 0;
+    if (device_load(DEVICE_TABLE_PATH, have_source ? &st : NULL)) {
+        return device.count;
+    }
+    if (!have_source || device_generate(conf, DEVICE_TABLE_PATH) < 0) {
+        return -1;
+    }
+    return device_load(DEVICE_TABLE_PATH, &st) ? device.count : -1;
+}
+
+static const device_t *device_by_signature(const uint8_t signature[3]) {
+    if (device.parts == NULL && device_open(NULL) < 0) return NULL;
+    uint32_t mask = device_header.sig_slots - 1;
+    for (uint32_t slot = device_hash_bytes(signature, 3, 0) & mask; device_sig_index[slot] != DEVICE_NO_ENTRY; slot = (slot + 1) & mask) {
+        const device_t *part = &device.parts[device_sig_index[slot]];
+        if (memcmp(part->signature, signature, 3) == 0) return part;
+    }
+    return NULL;
+}
+
+// Accepts the avrdude id ("t85") or the description ("ATtiny85"), in any case
+static const device_t *device_by_name(const char *name) {
+    if (device.parts == NULL && device_open(NULL) < 0) return NULL;
+    uint32_t mask = device_header.name_slots - 1;
+    for (uint32_t slot = device_hash_name(name) & mask; device_name_index[slot] != DEVICE_NO_ENTRY; slot = (slot + 1) & mask) {
+        const device_t *part = &device.parts[device_name_index[slot]];
+        if (strcasecmp(part->id, name) == 0 || strcasecmp(part->desc, name) == 0) return part;
+    }
+    return NULL;
+}
+
+static const device_fuse_t *device_fuse(const device_t *part, const char *name) {
+    for (int i = 0; i < part->fuse_count; i++) {
+        if (strcmp(part->fuses[i].name, name) == 0) return &part->fuses[i];
+    }
+    return NULL;
+}
+
+#endif // DEVICE_H
@@ -0,0 +1,124 @@
+#ifndef ELF_H
+#define ELF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ELF_MAGIC           "\x7f" "ELF"
+#define ELF_CLASS32         1
+#define ELF_DATA_LSB        1
+#define ELF_SHF_ALLOC       0x2
+
+typedef struct elf_t elf_t;
+
+typedef struct {
+    uint32_t text;
+    uint32_t data;
+    uint32_t bss;
+    uint32_t noinit;
+    uint32_t flash;         // .text + .data (the initializers live in flash)
+    uint32_t ram;           // .data + .bss + .noinit
+} elf_size_t;
+
+struct elf_t {
+    int (*size)     (const char *path, elf_size_t *size);
+};
+
+static int elf_size(const char *path, elf_size_t *size);
+
+static elf_t elf = {
+    .size = elf_size
+};
+
+// IMPLEMENTATIONS
+
+static uint16_t elf_u16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t elf_u32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Reads the section headers of a 32-bit little-endian ELF (what avr-gcc emits)
+// and totals the sections the way avr-size does, without spawning it
+static int elf_size(const char *path, elf_size_t *size) {
+    memset(size, 0, sizeof(*size));
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (length < 52) {
+        fclose(fp);
+        return -1;
+    }
+
+    uint8_t *image = malloc(length);
+    if (image == NULL || fread(image, 1, length, fp) != (size_t)length) {
+        free(image);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    if (memcmp(image, ELF_MAGIC, 4) != 0 || image[4] != ELF_CLASS32 || image[5] != ELF_DATA_LSB) {
+        free(image);
+        return -1;
+    }
+
+    uint32_t shoff = elf_u32(image + 32);
+    uint16_t shentsize = elf_u16(image + 46);
+    uint16_t shnum = elf_u16(image + 48);
+    uint16_t shstrndx = elf_u16(image + 50);
+    if (shentsize < 40 || shstrndx >= shnum || shoff + (uint64_t)shnum * shentsize > (uint64_t)length) {
+        free(image);
+        return -1;
+    }
+
+    const uint8_t *strtab_hdr = image + shoff + shstrndx * shentsize;
+    uint32_t strtab = elf_u32(strtab_hdr + 16);
+    uint32_t strtab_size = elf_u32(strtab_hdr + 20);
+    if (strtab + (uint64_t)strtab_size > (uint64_t)length) {
+        free(image);
+        return -1;
+    }
+
+    for (int i = 0; i < shnum; i++) {
+        const uint8_t *hdr = image + shoff + i * shentsize;
+        uint32_t name = elf_u32(hdr);
+        uint32_t flags = elf_u32(hdr + 8);
+        uint32_t bytes = elf_u32(hdr + 20);
+        if (name >= strtab_size || !(flags & ELF_SHF_ALLOC)) {
+            continue;
+        }
+
+        // A name not terminated inside .shstrtab is a truncated file; strcmp would run past it
+        const char *section = (const char *)image + strtab + name;
+        if (memchr(section, '\0', strtab_size - name) == NULL) {
+            continue;
+        }
+        if (strcmp(section, ".text") == 0) {
+            size->text += bytes;
+        } else if (strcmp(section, ".data") == 0) {
+            size->data += bytes;
+        } else if (strcmp(section, ".bss") == 0) {
+            size->bss += bytes;
+        } else if (strcmp(section, ".noinit") == 0) {
+            size->noinit += bytes;
+        }
+    }
+
+    size->flash = size->text + size->data;
+    size->ram = size->data + size->bss + size->noinit;
+
+    free(image);
+    return 0;
+}
+
+#endif // ELF_H
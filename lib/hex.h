@@ -0,0 +1,361 @@
+#ifndef HEX_H
+#define HEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HEX_MAX_IMAGE       0x20000     // 64K words, the most STK_LOAD_ADDRESS can reach
+#define HEX_CACHE_DIR       ".cache/hex"    // parsed images, one per source path
+#define HEX_MAGIC           0x5845484d  // "MHEX"
+#define HEX_VERSION         2
+#define HEX_ERROR_LENGTH    128
+#define HEX_RECORD_BYTES    16          // data bytes per record when writing, as avr-objcopy does
+
+// Record types
+#define HEX_DATA            0x00
+#define HEX_END_OF_FILE     0x01
+#define HEX_EXT_SEGMENT     0x02
+#define HEX_START_SEGMENT   0x03
+#define HEX_EXT_LINEAR      0x04
+#define HEX_START_LINEAR    0x05
+
+typedef struct hex_t hex_t;
+
+// Whole-file view of a HEX: bytes no record wrote stay 0xFF, like erased flash
+typedef struct {
+    unsigned char data[HEX_MAX_IMAGE];
+    unsigned int top;       // one past the highest byte address written
+} hex_image_t;
+
+// A cached image: this header, then data[0..top) of the image. The source is
+// only re-read when its inode, size or nanosecond mtime no longer match.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t source_mtime_ns;
+    int64_t source_size;
+    uint64_t source_inode;
+    uint32_t top;
+    uint32_t reserved;
+} hex_cache_header_t;
+
+struct hex_t {
+    int (*load)         (const char *path, hex_image_t *image);
+    int (*load_raw)     (const char *path, hex_image_t *image);
+    int (*parse)        (const char *text, size_t length, hex_image_t *image);
+    int (*save)         (const char *path, const hex_image_t *image, int raw);
+    const char *(*error)(void);
+};
+
+static int hex_load(const char *path, hex_image_t *image);
+static int hex_load_raw(const char *path, hex_image_t *image);
+static int hex_parse(const char *text, size_t length, hex_image_t *image);
+static int hex_save(const char *path, const hex_image_t *image, int raw);
+static const char *hex_error(void);
+
+static hex_t hex = {
+    .load = hex_load,
+    .load_raw = hex_load_raw,
+    .parse = hex_parse,
+    .save = hex_save,
+    .error = hex_error
+};
+
+static _Thread_local char hex_message[HEX_ERROR_LENGTH];
+
+// IMPLEMENTATIONS
+
+// Digit values with bit 4 set; 0 marks a character that is not a hex digit
+static const unsigned char hex_digit[256] = {
+    ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+    ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+    ['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D, ['E'] = 0x1E, ['F'] = 0x1F,
+    ['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D, ['e'] = 0x1E, ['f'] = 0x1F,
+};
+
+static const char *hex_error(void) {
+    return hex_message;
+}
+
+// Decodes count bytes from 2 * count characters; returns 0 on a non-hex character
+static int hex_decode(const unsigned char *p, unsigned char *out, int count) {
+    for (int i = 0; i < count; i++, p += 2) {
+        unsigned char hi = hex_digit[p[0]], lo = hex_digit[p[1]];
+        if (!(hi & lo & 0x10)) return 0;
+        out[i] = (hi << 4) | (lo & 0x0F);
+    }
+    return 1;
+}
+
+static uint64_t hex_hash(const unsigned char *data, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Parses HEX text in place. Every record's checksum is checked; extended segment
+// and linear address records move the base for the data records that follow.
+// Returns 0, or -1 with the reason in hex.error().
+static int hex_parse(const char *text, size_t length, hex_image_t *image) {
+    const unsigned char *p = (const unsigned char *)text;
+    const unsigned char *end = p + length;
+    unsigned int base = 0;
+    int segmented = 0;      // segment addresses wrap the offset within 64K
+    int line = 1;
+
+    memset(image->data, 0xFF, sizeof(image->data));
+    image->top = 0;
+
+    while (p < end) {
+        if (*p == '\n') line++;
+        if (*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+        if (*p != ':') {
+            snprintf(hex_message, sizeof(hex_message), "line %d: expected ':'", line);
+            return -1;
+        }
+
+        // :LLAAAATT then LL data bytes and the checksum
+        unsigned char record[5 + 255];
+        if (end - p < 11 || !hex_decode(p + 1, record, 1)) {
+            snprintf(hex_message, sizeof(hex_message), "line %d: truncated record", line);
+            return -1;
+        }
+        int count = record[0];
+        if (end - p < 11 + 2 * count || !hex_decode(p + 1, record, 5 + count)) {
+            snprintf(hex_message, sizeof(hex_message), "line %d: bad record", line);
+            return -1;
+        }
+        p += 11 + 2 * count;
+
+        unsigned char sum = 0;
+        for (int i = 0; i < 5 + count; i++) sum += record[i];
+        if (sum != 0) {
+            snprintf(hex_message, sizeof(hex_message), "line %d: checksum mismatch", line);
+            return -1;
+        }
+
+        if ((record[3] == HEX_EXT_SEGMENT || record[3] == HEX_EXT_LINEAR) && count != 2) {
+            snprintf(hex_message, sizeof(hex_message), "line %d: address record of %d bytes", line, count);
+            return -1;
+        }
+
+        unsigned int offset = (record[1] << 8) | record[2];
+        const unsigned char *data = record + 4;
+        switch (record[3]) {
+            case HEX_DATA:
+                for (int i = 0; i < count; i++) {
+                    unsigned int addr = segmented ? base + ((offset + i) & 0xFFFF) : base + offset + i;
+                    if (addr >= HEX_MAX_IMAGE) {
+                        snprintf(hex_message, sizeof(hex_message), "line %d: address 0x%X is beyond 0x%X", line, addr, HEX_MAX_IMAGE);
+                        return -1;
+                    }
+                    image->data[addr] = data[i];
+                    if (addr + 1 > image->top) image->top = addr + 1;
+                }
+                break;
+            case HEX_END_OF_FILE:
+                return 0;
+            case HEX_EXT_SEGMENT:
+                base = ((data[0] << 8) | data[1]) << 4;
+                segmented = 1;
+                break;
+            case HEX_EXT_LINEAR:
+                base = ((data[0] << 8) | data[1]) << 16;
+                segmented = 0;
+                break;
+            case HEX_START_SEGMENT:
+            case HEX_START_LINEAR:
+                break;  // entry points mean nothing to an AVR
+            default:
+                snprintf(hex_message, sizeof(hex_message), "line %d: unknown record type %02X", line, record[3]);
+                return -1;
+        }
+    }
+    return 0;  // tolerate a missing end-of-file record, as avrdude does
+}
+
+static int64_t hex_mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Names the cache of a source by a hash of its absolute path, so any HEX can be
+// cached without writing next to it (backups may sit in read-only directories)
+static int hex_cache_path(const char *source, char *path, size_t size) {
+    char absolute[PATH_MAX];
+    if (realpath(source, absolute) == NULL) {
+        return 0;
+    }
+    snprintf(path, size, "%s/%016llx.img", HEX_CACHE_DIR,
+             (unsigned long long)hex_hash((const unsigned char *)absolute, strlen(absolute)));
+    return 1;
+}
+
+static int hex_load_cache(const char *path, const struct stat *source, hex_image_t *image) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return 0;
+
+    hex_cache_header_t header;
+    int ok = fread(&header, sizeof(header), 1, fp) == 1 && header.magic == HEX_MAGIC &&
+             header.version == HEX_VERSION && header.source_mtime_ns == hex_mtime_ns(source) &&
+             header.source_size == source->st_size && header.source_inode == (uint64_t)source->st_ino &&
+             header.top <= HEX_MAX_IMAGE && fread(image->data, 1, header.top, fp) == header.top;
+    fclose(fp);
+    if (ok) {
+        memset(image->data + header.top, 0xFF, HEX_MAX_IMAGE - header.top);
+        image->top = header.top;
+    }
+    return ok;
+}
+
+static void hex_save_cache(const char *path, const struct stat *source, const hex_image_t *image) {
+    hex_cache_header_t header = {
+        .magic = HEX_MAGIC,
+        .version = HEX_VERSION,
+        .source_mtime_ns = hex_mtime_ns(source),
+        .source_size = source->st_size,
+        .source_inode = source->st_ino,
+        .top = image->top
+    };
+    mkdir(".cache", 0755);
+    mkdir(HEX_CACHE_DIR, 0755);
+    // A unique temporary, since several threads may load the same file at once
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (fd >= 0 && fp == NULL) close(fd);
+    int ok = fp != NULL &&
+             fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(image->data, 1, image->top, fp) == image->top;
+    if (fp != NULL && fclose(fp) != 0) ok = 0;
+    if (ok) ok = rename(tmp, path) == 0;
+    if (!ok && fd >= 0) remove(tmp);
+}
+
+// Returns the image cached under HEX_CACHE_DIR while the file's inode, size and
+// mtime still match, without reading the file; otherwise maps and parses it and
+// refreshes the cache. Returns 0, or -1 with hex.error() set.
+static int hex_load(const char *path, hex_image_t *image) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        snprintf(hex_message, sizeof(hex_message), "cannot open %s", path);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        snprintf(hex_message, sizeof(hex_message), "%s is empty", path);
+        return -1;
+    }
+    char cache[sizeof(HEX_CACHE_DIR) + 32];
+    int cached = hex_cache_path(path, cache, sizeof(cache));
+    if (cached && hex_load_cache(cache, &st, image)) {
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        snprintf(hex_message, sizeof(hex_message), "cannot open %s", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    const char *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        snprintf(hex_message, sizeof(hex_message), "cannot map %s", path);
+        return -1;
+    }
+    int result = hex_parse(text, st.st_size, image);
+    if (result == 0 && cached) hex_save_cache(cache, &st, image);
+    munmap((void *)text, st.st_size);
+    return result;
+}
+
+// Reads a binary file as the image from address 0
+static int hex_load_raw(const char *path, hex_image_t *image) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        snprintf(hex_message, sizeof(hex_message), "cannot open %s", path);
+        return -1;
+    }
+    memset(image->data, 0xFF, sizeof(image->data));
+    size_t n = fread(image->data, 1, HEX_MAX_IMAGE, fp);
+    int too_long = fgetc(fp) != EOF;
+    fclose(fp);
+    if (too_long) {
+        snprintf(hex_message, sizeof(hex_message), "%s is larger than 0x%X bytes", path, HEX_MAX_IMAGE);
+        return -1;
+    }
+    image->top = n;
+    return 0;
+}
+
+static void hex_write_record(FILE *fp, int type, unsigned int offset, const unsigned char *data, int count) {
+    static const char digits[] = "0123456789ABCDEF";
+    unsigned char record[4 + HEX_RECORD_BYTES] = {count, (offset >> 8) & 0xFF, offset & 0xFF, type};
+    memcpy(record + 4, data, count);
+    char line[1 + 2 * (5 + HEX_RECORD_BYTES) + 2];
+    unsigned char sum = 0;
+    char *p = line;
+    *p++ = ':';
+    for (int i = 0; i < 4 + count; i++) {
+        sum += record[i];
+        *p++ = digits[record[i] >> 4];
+        *p++ = digits[record[i] & 0x0F];
+    }
+    sum = -sum;
+    *p++ = digits[sum >> 4];
+    *p++ = digits[sum & 0x0F];
+    *p++ = '\n';
+    fwrite(line, 1, p - line, fp);
+}
+
+// Writes [0, top) of the image as raw bytes, or as Intel HEX. The HEX leaves out
+// records that would hold only 0xFF, since loading reads missing bytes as erased.
+static int hex_save(const char *path, const hex_image_t *image, int raw) {
+    FILE *fp = fopen(path, raw ? "wb" : "w");
+    if (fp == NULL) {
+        snprintf(hex_message, sizeof(hex_message), "cannot create %s", path);
+        return -1;
+    }
+
+    if (raw) {
+        fwrite(image->data, 1, image->top, fp);
+    } else {
+        unsigned int upper = 0;
+        for (unsigned int addr = 0; addr < image->top; addr += HEX_RECORD_BYTES) {
+            int count = image->top - addr < HEX_RECORD_BYTES ? image->top - addr : HEX_RECORD_BYTES;
+            int blank = 1;
+            for (int i = 0; i < count && blank; i++) blank = image->data[addr + i] == 0xFF;
+            if (blank) continue;
+
+            if (addr >> 16 != upper) {
+                upper = addr >> 16;
+                unsigned char base[2] = {(upper >> 8) & 0xFF, upper & 0xFF};
+                hex_write_record(fp, HEX_EXT_LINEAR, 0, base, 2);
+            }
+            hex_write_record(fp, HEX_DATA, addr & 0xFFFF, image->data + addr, count);
+        }
+        hex_write_record(fp, HEX_END_OF_FILE, 0, NULL, 0);
+    }
+
+    int failed = ferror(fp);
+    if (fclose(fp) != 0) failed = 1;
+    if (failed) {
+        snprintf(hex_message, sizeof(hex_message), "cannot write %s", path);
+        return -1;
+    }
+    return 0;
+}
+
+#endif // HEX_H
@@ -0,0 +1,323 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <cosmo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "libc/dce.h"
+
+#define SERIAL_WRITE_TIMEOUT_US   500000  // a frame the driver will not take by then is lost
+#define SERIAL_DRAIN_QUIET_US     20000   // drain() returns once the port stays silent this long
+#define SERIAL_RESET_PULSE_US     50000   // DTR low time; the auto-reset capacitor needs a few ms
+#define SERIAL_MAX_FRAME          600     // largest frame send() assembles on the stack
+
+typedef struct serial_t serial_t;
+
+// One piece of a frame handed to send(), e.g. command byte, payload, CRC_EOP
+typedef struct {
+    const void *data;
+    size_t length;
+} serial_chunk_t;
+
+// Raw 8N1 serial ports for the uploaders. Ports are opened non-blocking and every
+// wait is bounded by an absolute deadline on the now() clock, so a silent or
+// unplugged programmer costs a timeout, never a hang. A frame goes to the driver
+// in a single write(), which keeps it in one USB packet on USB-serial adapters.
+struct serial_t {
+    int (*open)         (const char *path, int baud);
+    int (*configure)    (int fd, int baud);
+    void (*dtr)         (int fd, int on);
+    void (*reset)       (const int *fds, int count);
+    int (*write)        (int fd, const void *data, size_t length);
+    int (*send)         (int fd, const serial_chunk_t *chunks, int count);
+    int (*read)         (int fd, void *data, size_t size, long long deadline);
+    int (*read_exact)   (int fd, void *data, size_t length, long long deadline);
+    int (*wait_any)     (const int *fds, int count, long long deadline);
+    void (*drain)       (int fd);
+    long long (*now)    (void);
+};
+
+static int serial_open(const char *path, int baud);
+static int serial_configure(int fd, int baud);
+static void serial_dtr(int fd, int on);
+static void serial_reset(const int *fds, int count);
+static int serial_write(int fd, const void *data, size_t length);
+static int serial_send(int fd, const serial_chunk_t *chunks, int count);
+static int serial_read(int fd, void *data, size_t size, long long deadline);
+static int serial_read_exact(int fd, void *data, size_t length, long long deadline);
+static int serial_wait_any(const int *fds, int count, long long deadline);
+static void serial_drain(int fd);
+static long long serial_now(void);
+
+static serial_t serial = {
+    .open = serial_open,
+    .configure = serial_configure,
+    .dtr = serial_dtr,
+    .reset = serial_reset,
+    .write = serial_write,
+    .send = serial_send,
+    .read = serial_read,
+    .read_exact = serial_read_exact,
+    .wait_any = serial_wait_any,
+    .drain = serial_drain,
+    .now = serial_now
+};
+
+// IMPLEMENTATIONS
+
+// Monotonic microseconds; deadlines passed to read() and friends are on this clock
+static long long serial_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Milliseconds left until `deadline`, rounded up so poll() never wakes early
+static int serial_remaining_ms(long long deadline) {
+    long long remaining = deadline - serial_now();
+    return remaining > 0 ? (int)((remaining + 999) / 1000) : 0;
+}
+
+static int serial_speed(int baud, speed_t *speed) {
+    switch (baud) {
+        case 9600:   *speed = B9600;   return 1;
+        case 19200:  *speed = B19200;  return 1;
+        case 38400:  *speed = B38400;  return 1;
+        case 57600:  *speed = B57600;  return 1;
+        case 115200: *speed = B115200; return 1;
+        default:     return 0;
+    }
+}
+
+// Sets raw 8N1 at `baud` with no flow control. HUPCL is cleared so closing the
+// port leaves DTR up and reopening it does not reset the board. Windows ports
+// are configured by open() through `mode`, which also takes the baud rate.
+static int serial_configure(int fd, int baud) {
+    speed_t speed;
+    if (!serial_speed(baud, &speed)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (IsWindows()) {
+        return 0;
+    }
+
+    struct termios tty;
+    memset(&tty, 0, sizeof(tty));
+    if (tcgetattr(fd, &tty) != 0) {
+        return -1;
+    }
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8 | CLOCAL | CREAD;
+    tty.c_cflag &= ~(PARENB | PARODD | CSTOPB | CRTSCTS | HUPCL);
+    tty.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHONL | ISIG);
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY | IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL);
+    tty.c_oflag &= ~(OPOST | ONLCR);
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;  // reads never block; waits go through poll() with a deadline
+    return tcsetattr(fd, TCSANOW, &tty);
+}
+
+// Opens and configures a port with DTR and RTS asserted. The board is not
+// reset here; that is left to reset(), so many ports can share one pulse.
+static int serial_open(const char *path, int baud) {
+    if (IsWindows()) {
+        char cmd[256];
+        snprintf(cmd, sizeof(cmd),
+            "cmd.exe /c mode %s: BAUD=%d PARITY=N DATA=8 STOP=1 dtr=on rts=on", path, baud);
+        if (system(cmd) != 0) {
+            return -1;
+        }
+
+        int fd = open(path, O_RDWR | O_NONBLOCK);
+        if (fd < 0) return -1;
+
+        HANDLE hComm = (HANDLE)_get_osfhandle(fd);
+        if (hComm == INVALID_HANDLE_VALUE) {
+            close(fd);
+            return -1;
+        }
+        EscapeCommFunction(hComm, SETDTR);
+        EscapeCommFunction(hComm, SETRTS);
+        return fd;
+    }
+
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) return -1;
+
+    int bits;
+    if (ioctl(fd, TIOCMGET, &bits) == 0) {
+        bits |= TIOCM_DTR | TIOCM_RTS;
+        ioctl(fd, TIOCMSET, &bits);
+    }
+
+    if (serial_configure(fd, baud) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+static void serial_dtr(int fd, int on) {
+    if (IsWindows()) {
+        HANDLE hComm = (HANDLE)_get_osfhandle(fd);
+        EscapeCommFunction(hComm, on ? SETDTR : CLRDTR);
+    } else {
+        int bits;
+        if (ioctl(fd, TIOCMGET, &bits) != 0) return;
+        if (on) {
+            bits |= TIOCM_DTR;
+        } else {
+            bits &= ~TIOCM_DTR;
+        }
+        ioctl(fd, TIOCMSET, &bits);
+    }
+}
+
+// Pulses DTR on every port at once, so resetting N boards costs one pulse
+static void serial_reset(const int *fds, int count) {
+    for (int i = 0; i < count; i++) {
+        serial_dtr(fds[i], 0);
+    }
+    usleep(SERIAL_RESET_PULSE_US);
+    for (int i = 0; i < count; i++) {
+        serial_dtr(fds[i], 1);
+    }
+}
+
+// Writes all of `data`, normally in one write(); a full driver buffer is waited
+// out with poll() for at most SERIAL_WRITE_TIMEOUT_US. Returns 1 on success.
+static int serial_write(int fd, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    long long deadline = serial_now() + SERIAL_WRITE_TIMEOUT_US;
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write(fd, bytes + done, length - done);
+        if (n > 0) {
+            done += n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            return 0;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        if (poll(&pfd, 1, serial_remaining_ms(deadline)) <= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Gathers the chunks of one frame into a single buffer and writes it at once,
+// rather than a write() per chunk that the driver may send as separate packets
+static int serial_send(int fd, const serial_chunk_t *chunks, int count) {
+    unsigned char frame[SERIAL_MAX_FRAME];
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+        if (chunks[i].length > sizeof(frame) - length) {
+            errno = EMSGSIZE;
+            return 0;
+        }
+        memcpy(frame + length, chunks[i].data, chunks[i].length);
+        length += chunks[i].length;
+    }
+    return serial_write(fd, frame, length);
+}
+
+// Reads whatever is available, up to `size` bytes, waiting for the first byte
+// until `deadline`. Returns the byte count, 0 once the deadline passes, -1 on error.
+static int serial_read(int fd, void *data, size_t size, long long deadline) {
+    for (;;) {
+        ssize_t n = read(fd, data, size);
+        if (n > 0) {
+            return (int)n;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+        // n == 0 is an idle tty on some platforms, the same as EAGAIN
+        int ms = serial_remaining_ms(deadline);
+        if (ms <= 0) {
+            return 0;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, ms);
+        if (ready < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (ready == 0) {
+            return 0;
+        }
+        if (ready > 0 && !(pfd.revents & POLLIN)) {
+            return -1;  // hung up or failed, nothing will arrive
+        }
+    }
+}
+
+// Reads exactly `length` bytes or fails at the deadline. Returns 1 on success.
+static int serial_read_exact(int fd, void *data, size_t length, long long deadline) {
+    unsigned char *bytes = data;
+    size_t done = 0;
+    while (done < length) {
+        int n = serial_read(fd, bytes + done, length - done, deadline);
+        if (n <= 0) {
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+// Waits until one of `fds` has input and returns its index, or -1 at the
+// deadline. Negative descriptors are skipped, as poll() ignores them, and so
+// are ports that hang up while waiting, so one unplugged board cannot end the wait.
+static int serial_wait_any(const int *fds, int count, long long deadline) {
+    struct pollfd pfds[count > 0 ? count : 1];
+    for (int i = 0; i < count; i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+    }
+    for (;;) {
+        int ms = serial_remaining_ms(deadline);
+        if (ms <= 0) {
+            return -1;
+        }
+        int ready = poll(pfds, count, ms);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            if (pfds[i].revents & POLLIN) return i;
+        }
+        for (int i = 0; i < count; i++) {
+            if (pfds[i].revents) pfds[i].fd = -1;  // hung up or failed
+        }
+    }
+}
+
+// Discards anything still in flight (boot banners, stale replies) until the
+// port has been quiet for SERIAL_DRAIN_QUIET_US
+static void serial_drain(int fd) {
+    unsigned char junk[128];
+    while (serial_read(fd, junk, sizeof(junk), serial_now() + SERIAL_DRAIN_QUIET_US) > 0) {
+        // Discard data
+    }
+}
+
+#endif // SERIAL_H
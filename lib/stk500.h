@@ -0,0 +1,2039 @@
+#ifndef STK500_H
+#define STK500_H
+
+#include <cosmo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <termios.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libc/dce.h"
+
+#include "device.h"
+#include "hex.h"
+#include "serial.h"
+
+// STK500v1 constants
+#define STK_GET_SYNC       '0'
+#define STK_GET_SIGN_ON    '1'
+#define STK_SET_PARAMETER  '@'
+#define STK_GET_PARAMETER  'A'
+#define STK_SET_DEVICE     'B'
+#define STK_SET_DEVICE_EXT 'E'
+#define STK_ENTER_PROGMODE 'P'
+#define STK_LEAVE_PROGMODE 'Q'
+#define STK_CHIP_ERASE     'R'
+#define STK_CHECK_AUTOINC  'S'
+#define STK_LOAD_ADDRESS   'U'
+#define STK_UNIVERSAL      'V'
+#define STK_PROG_FLASH     '`'
+#define STK_PROG_DATA      'a'
+#define STK_PROG_FUSE      'b'
+#define STK_PROG_LOCK      'c'
+#define STK_PROG_PAGE      'd'
+#define STK_READ_FLASH     'p'
+#define STK_READ_DATA      'q'
+#define STK_READ_FUSE      'r'
+#define STK_READ_LOCK      's'
+#define STK_READ_PAGE      't'
+#define STK_READ_SIGN      'u'
+#define STK_SW_MAJOR       0x81
+#define STK_SW_MINOR       0x82
+
+#define STK_OK              0x10
+#define STK_FAILED          0x11
+#define STK_UNKNOWN         0x12
+#define STK_NODEVICE        0x13
+#define STK_INSYNC          0x14
+#define STK_NOSYNC          0x15
+
+#define CRC_EOP             0x20
+
+// Target geometry comes from the device table; these bound the buffers
+#define STK500_DEFAULT_PART        "t85"
+#define STK500_MAX_PAGE_SIZE       256
+#define STK500_MAX_FLASH_SIZE      HEX_MAX_IMAGE
+#define STK500_MAX_PAGE_COUNT      1024
+
+// Timeouts and delays
+#define STK500_INIT_DELAY_US       2000000
+#define STK500_READ_TIMEOUT_US     500000
+#define STK500_RESET_PULSE_US      50000
+#define STK500_SYNC_ATTEMPTS       3
+#define STK500_DEFAULT_WINDOW      4   // frames in flight when pipelining (1 = stop-and-wait)
+#define STK500_MAX_WINDOW          16
+#define STK500_CHIP_ERASE_DELAY_US 9000 // used when the part does not specify one
+#define STK500_READ_CHUNK          256 // largest STK_READ_PAGE transfer ArduinoISP answers
+#define STK500_FLASH_CACHE_DIR     ".cache/flash"
+#define STK500_SESSION_CACHE_FILE  ".cache/session"
+#define STK500_QUICK_SYNC_ATTEMPTS 2   // syncs tried on the remembered port before resetting it
+#define STK500_FUSE_POLL_US        1000
+#define STK500_PARM_SCK_DURATION   0x89  // Parm_STK_SCK_DURATION
+#define STK500_ISP_CLOCK_FILE      ".cache/isp_clock"
+#define STK500_STAGE_TIME_FILE     ".cache/stage_times"
+#define STK500_ETA_PRIOR_UNITS     8     // how many units of this stage the remembered per-unit time is worth
+#define STK500_SCK_UNKNOWN         -1
+#define STK500_SCK_UNSUPPORTED     -2    // the programmer rejects STK_SET_PARAMETER
+#define STK500_FUSE_TIMEOUT_US     20000 // t_WD_FUSE is 4.5 ms; allow for slow parts
+#define STK500_EEPROM_MAX_SPAN     8     // ArduinoISP waits ~45 ms per EEPROM byte before it answers
+#define STK500_EEPROM_WINDOW       2     // EEPROM frames in flight; more can overrun ArduinoISP's 64-byte RX buffer
+
+// Buffer sizes
+#define STK500_MAX_PORTS           64
+#define STK500_PORT_NAME_LENGTH    32
+#define STK500_RESPONSE_BUFFER     275
+#define STK500_SERIAL_NUMBER_LENGTH 64
+#define STK500_SYSFS_ROOT_ENV      "M_SYSFS_ROOT"  // alternate sysfs tree, e.g. a fake one for testing
+#define STK500_SYSFS_TTY_CLASS     "/sys/class/tty"
+#define STK500_SYSFS_MAX_DEPTH     4
+#define STK500_RING_SIZE           1024
+#define STK500_SIGN_ON_LENGTH      9   // STK_INSYNC + "AVR ISP" + STK_OK
+
+// Telemetry
+#define STK500_BAUD                19200  // ArduinoISP's fixed rate, also the line rate reports compare against
+#define STK500_BITS_PER_BYTE       10  // start + 8 data + stop
+#define STK500_RTT_BUCKETS         12  // bucket b counts RTTs under 250 us << b; the last one is open-ended
+#define STK500_RTT_FIRST_US        250
+
+typedef struct {
+    unsigned char data[STK500_MAX_PAGE_SIZE];
+    unsigned int address;   // word address, as STK_LOAD_ADDRESS takes it
+    size_t length;
+    char memtype;           // 'F' flash or 'E' EEPROM
+} stk500_page_t;
+
+typedef enum {
+    STK500_FULL,    // chip erase, then every non-blank page
+    STK500_DIFF,    // read the device back and write only pages that changed
+    STK500_CACHED   // like STK500_DIFF, but trust the image cached for this signature
+} stk500_mode_t;
+
+// Whole-file view of the HEX: unprogrammed bytes stay 0xFF, like erased flash
+typedef hex_image_t stk500_image_t;
+
+// A candidate serial port; vid/pid/serial are only known where USB enumeration is available
+typedef struct {
+    char name[STK500_PORT_NAME_LENGTH];
+    unsigned int vid;
+    unsigned int pid;
+    char serial[STK500_SERIAL_NUMBER_LENGTH];
+    int rank;               // lower is tried first
+} stk500_port_t;
+
+// USB IDs of adapters that usually carry an ArduinoISP, best first
+typedef struct {
+    unsigned int vid;
+    unsigned int pid;       // 0 matches any product of the vendor
+    int rank;
+    const char *name;
+} stk500_known_t;
+
+static const stk500_known_t stk500_known_programmers[] = {
+    { 0x2341, 0,      0, "Arduino" },
+    { 0x2A03, 0,      0, "Arduino (.org)" },
+    { 0x1A86, 0x7523, 1, "CH340" },
+    { 0x0403, 0x6001, 1, "FTDI FT232R" },
+    { 0x0403, 0x6015, 1, "FTDI FT231X" },
+    { 0x10C4, 0xEA60, 2, "CP210x" },
+};
+
+// What the last successful upload learned, so the next run can go straight to it
+typedef struct {
+    int valid;
+    char port[STK500_PORT_NAME_LENGTH];
+    char serial[STK500_SERIAL_NUMBER_LENGTH];  // USB serial number; survives ttyACM renumbering
+    unsigned int vid;
+    unsigned int pid;
+    char version[STK500_SIGN_ON_LENGTH];       // sign-on reply without INSYNC/OK, e.g. "AVR ISP"
+    unsigned char signature[3];
+} stk500_session_t;
+
+// Session state is per thread, so several programmers can run side by side
+static _Thread_local stk500_session_t stk500_session;
+static _Thread_local int stk500_remember;  // save the session on a successful close (connect, not open)
+
+#define STK500_KNOWN_PROGRAMMERS (sizeof(stk500_known_programmers) / sizeof(stk500_known_programmers[0]))
+#define STK500_UNKNOWN_USB_RANK    3
+
+// A frame that has been sent but whose response has not been matched yet.
+// The bytes are kept so the frame can be replayed after a pipeline failure.
+typedef struct {
+    unsigned char frame[STK500_MAX_PAGE_SIZE + 5];
+    size_t length;
+    size_t resp_len;
+    unsigned int address;
+    unsigned char *out;     // receives the response payload (between INSYNC and OK), if any
+    long long sent_us;
+    int units;              // stage progress this frame completes once answered
+    unsigned int bytes;     // payload it carries either way, for the stage's byte rate
+    int reload;             // a page frame: replay re-sends LOAD_ADDRESS `load` first, since
+    unsigned int load;      // the programmer moved `here` past the page when it ran
+} stk500_pending_t;
+
+typedef struct {
+    int fd;
+    int window;     // maximum frames awaiting a response
+    stk500_pending_t queue[STK500_MAX_WINDOW];
+    int head;
+    int count;
+} stk500_pipeline_t;
+
+// Command kinds that telemetry keeps apart
+typedef enum {
+    STK500_CMD_SYNC,
+    STK500_CMD_LOAD_ADDRESS,
+    STK500_CMD_PROG_PAGE,
+    STK500_CMD_READ_PAGE,
+    STK500_CMD_UNIVERSAL,
+    STK500_CMD_OTHER,
+    STK500_CMD_KINDS
+} stk500_command_kind_t;
+
+static const char *stk500_command_names[STK500_CMD_KINDS] = {
+    "sync", "load_address", "prog_page", "read_page", "universal", "other"
+};
+
+// Round trips of one command kind: from handing the frame to write() until its
+// whole response was matched, so pipelined frames include their time in the queue
+typedef struct {
+    unsigned long count;
+    unsigned long failed;
+    long long total_us;
+    long long min_us;
+    long long max_us;
+    unsigned long histogram[STK500_RTT_BUCKETS];
+} stk500_rtt_t;
+
+typedef struct {
+    stk500_rtt_t commands[STK500_CMD_KINDS];
+    unsigned long bytes_out;
+    unsigned long bytes_in;
+    long long write_us;     // inside write(), handing frames to the driver
+    long long wait_us;      // blocked until response bytes arrived
+    long long start_us;     // connect or open
+    long long end_us;       // close, 0 while the session is open
+} stk500_telemetry_t;
+
+static _Thread_local stk500_telemetry_t stk500_telemetry;
+
+// Receive ring: partial reads accumulate here until a whole frame is present,
+// and bytes that arrive past the end of one frame stay for the next
+typedef struct {
+    unsigned char data[STK500_RING_SIZE];
+    size_t head;    // total bytes written
+    size_t tail;    // total bytes consumed
+} stk500_ring_t;
+
+static _Thread_local stk500_ring_t stk500_rx_ring;
+
+// The part being programmed and its flash geometry
+static _Thread_local const device_t *stk500_part;
+static _Thread_local int stk500_in_progmode;
+
+// SCK durations tried when entering progmode, fastest first. In STK500 firmware
+// units 0 is ~921 kHz, 1 ~230 kHz, 2 ~115 kHz, 3 ~57.6 kHz; larger is slower still.
+// An 8 MHz target (lfuse 0xE2) takes ISP clocks up to 2 MHz, a 1 MHz one 250 kHz.
+static const unsigned char stk500_sck_ladder[] = {0, 1, 2, 3, 10, 50, 254};
+static _Thread_local int stk500_isp_clock = STK500_SCK_UNKNOWN;
+
+#define STK500_SCK_STEPS (sizeof(stk500_sck_ladder) / sizeof(stk500_sck_ladder[0]))
+
+static _Thread_local int stk500_page_size;
+static _Thread_local unsigned int stk500_flash_size;
+static _Thread_local int stk500_page_count;
+
+// Serializes the read-modify-write of the shared files under .cache
+static pthread_mutex_t stk500_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One step of a long stage. Units are counted when the programmer has answered
+// for them, not when they were sent, so a stalled programmer stops the count.
+typedef struct {
+    const char *stage;      // "READ", "CONFIRM", "FLASH", "VERIFY" or "EEPROM"
+    const char *unit;       // what done/total count: "pages" or "bytes"
+    int done;
+    int total;
+    unsigned long bytes;    // payload moved so far in this stage
+    double bytes_per_s;     // 0 until the first unit is answered
+    double elapsed_s;
+    double eta_s;           // seconds left, -1 while there is nothing to go on
+    int calibrated;         // the estimate includes this port's earlier runs of the stage
+} stk500_progress_t;
+
+typedef enum {
+    STK500_MESSAGE,     // void handler(const char *text), one line without the newline
+    STK500_PROGRESS,    // void handler(const stk500_progress_t *progress)
+    STK500_EVENT_COUNT
+} stk500_event_t;
+
+typedef struct stk500_t stk500_t;
+
+// One ArduinoISP programming session: connect once, then any mix of fuse and
+// flash operations, then close. Output goes to stdout unless a handler listens.
+// The session, its handlers and this struct are thread-local: each thread that
+// calls open() drives its own programmer, and a loaded image can be shared.
+struct stk500_t {
+    int fd;                 // -1 while no session is open
+    int window;             // frames in flight when pipelining (1 = stop-and-wait)
+    const device_t *part;   // the connected target, once its signature was read
+
+    int (*connect)          (const char *part_name, unsigned int vid, unsigned int pid, int rescan, int wait_ms);
+    int (*open)             (const stk500_port_t *port, const char *part_name);
+    int (*ports)            (stk500_port_t ports[], unsigned int vid, unsigned int pid);
+    int (*read_fuse)        (const char *name, unsigned char *value);
+    int (*write_fuse)       (const char *name, unsigned char value);
+    int (*load)             (const char *filename, stk500_image_t *image);
+    int (*flash)            (const char *filename, stk500_mode_t mode, int verify);
+    int (*flash_image)      (const stk500_image_t *image, stk500_mode_t mode, int verify);
+    int (*eeprom)           (const char *filename, int verify);
+    int (*eeprom_image)     (const stk500_image_t *image, int verify);
+    int (*read_memory)      (char memtype, stk500_image_t *image);
+    int (*close)            (int success);
+    void (*listen)          (stk500_event_t event, void *handler);
+    const char *(*port)     (void);
+    void (*report)          (void);
+    int (*dump)             (const char *path);
+};
+
+static int stk500_connect(const char *part_name, unsigned int vid, unsigned int pid, int rescan, int wait_ms);
+static int stk500_open(const stk500_port_t *port, const char *part_name);
+static int stk500_get_available_ports(stk500_port_t ports[], unsigned int vid, unsigned int pid);
+static int stk500_read_fuse(const char *name, unsigned char *value);
+static int stk500_write_fuse(const char *name, unsigned char value);
+static int stk500_load_hex_file(const char *filename, stk500_image_t *image);
+static int stk500_flash(const char *filename, stk500_mode_t mode, int verify);
+static int stk500_flash_image(const stk500_image_t *image, stk500_mode_t mode, int verify);
+static int stk500_write_eeprom(const char *filename, int verify);
+static int stk500_eeprom_image(const stk500_image_t *image, int verify);
+static int stk500_read_memory(char memtype, stk500_image_t *image);
+static int stk500_close(int success);
+static void stk500_listen(stk500_event_t event, void *handler);
+static const char *stk500_port(void);
+static void stk500_report(void);
+static int stk500_dump(const char *path);
+
+static _Thread_local stk500_t stk500 = {
+    .fd = -1,
+    .window = STK500_DEFAULT_WINDOW,
+    .part = NULL,
+    .connect = stk500_connect,
+    .open = stk500_open,
+    .ports = stk500_get_available_ports,
+    .read_fuse = stk500_read_fuse,
+    .write_fuse = stk500_write_fuse,
+    .load = stk500_load_hex_file,
+    .flash = stk500_flash,
+    .flash_image = stk500_flash_image,
+    .eeprom = stk500_write_eeprom,
+    .eeprom_image = stk500_eeprom_image,
+    .read_memory = stk500_read_memory,
+    .close = stk500_close,
+    .listen = stk500_listen,
+    .port = stk500_port,
+    .report = stk500_report,
+    .dump = stk500_dump
+};
+
+static _Thread_local void (*stk500_message_handler)(const char *text);
+static _Thread_local void (*stk500_progress_handler)(const stk500_progress_t *progress);
+
+// IMPLEMENTATIONS
+
+static void stk500_listen(stk500_event_t event, void *handler) {
+    switch (event) {
+        case STK500_MESSAGE:
+            stk500_message_handler = (void (*)(const char *))handler;
+            break;
+        case STK500_PROGRESS:
+            stk500_progress_handler = (void (*)(const stk500_progress_t *))handler;
+            break;
+        default:
+            break;
+    }
+}
+
+static void stk500_log(const char *format, ...) {
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    if (stk500_message_handler == NULL) {
+        fputs(text, stdout);
+        fflush(stdout);
+        return;
+    }
+    text[strcspn(text, "\n")] = 0;
+    if (text[0]) stk500_message_handler(text);
+}
+
+static void stk500_telemetry_reset(void) {
+    memset(&stk500_telemetry, 0, sizeof(stk500_telemetry));
+    stk500_telemetry.start_us = serial.now();
+}
+
+static stk500_command_kind_t stk500_command_kind(unsigned char command) {
+    switch (command) {
+        case STK_GET_SYNC:      return STK500_CMD_SYNC;
+        case STK_LOAD_ADDRESS:  return STK500_CMD_LOAD_ADDRESS;
+        case STK_PROG_PAGE:     return STK500_CMD_PROG_PAGE;
+        case STK_READ_PAGE:     return STK500_CMD_READ_PAGE;
+        case STK_UNIVERSAL:     return STK500_CMD_UNIVERSAL;
+        default:                return STK500_CMD_OTHER;
+    }
+}
+
+static void stk500_telemetry_record(unsigned char command, long long sent_us, int ok) {
+    stk500_rtt_t *rtt = &stk500_telemetry.commands[stk500_command_kind(command)];
+    if (!ok) {
+        rtt->failed++;
+        return;
+    }
+    long long us = serial.now() - sent_us;
+    int bucket = 0;
+    while (bucket < STK500_RTT_BUCKETS - 1 && us >= (long long)STK500_RTT_FIRST_US << bucket) {
+        bucket++;
+    }
+    rtt->histogram[bucket]++;
+    if (rtt->count == 0 || us < rtt->min_us) rtt->min_us = us;
+    if (us > rtt->max_us) rtt->max_us = us;
+    rtt->total_us += us;
+    rtt->count++;
+}
+
+// Names the programmer in the keyed cache files: its USB serial number when
+// enumeration gave one, since the tty name may move, otherwise the port
+static const char *stk500_port_key(void) {
+    return stk500_session.serial[0] ? stk500_session.serial : stk500_session.port;
+}
+
+// The files under .cache that hold one "key value" line per key. Returns the
+// value of the last line for `key`, or 0 when there is none.
+static int stk500_load_keyed(const char *path, const char *key, char *value, size_t size) {
+    char line[256];
+    size_t length = strlen(key);
+    int found = 0;
+    pthread_mutex_lock(&stk500_cache_lock);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (strncmp(line, key, length) == 0 && line[length] == ' ') {
+                line[strcspn(line, "\n")] = 0;
+                snprintf(value, size, "%s", line + length + 1);
+                found = 1;
+            }
+        }
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&stk500_cache_lock);
+    return found;
+}
+
+static void stk500_save_keyed(const char *path, const char *key, const char *value) {
+    char line[256];
+    size_t length = strlen(key);
+
+    // Rewrite the file with this key's line replaced
+    char *kept = NULL;
+    size_t kept_length = 0;
+    FILE *out = open_memstream(&kept, &kept_length);
+    if (out == NULL) return;
+    pthread_mutex_lock(&stk500_cache_lock);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (strncmp(line, key, length) != 0 || line[length] != ' ') fputs(line, out);
+        }
+        fclose(fp);
+    }
+    fprintf(out, "%s %s\n", key, value);
+    fclose(out);
+
+    mkdir(".cache", 0755);
+    fp = fopen(path, "w");
+    if (fp) {
+        fwrite(kept, 1, kept_length, fp);
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&stk500_cache_lock);
+    free(kept);
+}
+
+// Timing of the running stage behind the progress events. Per-unit times are
+// remembered per programmer, part, stage, unit and window, since the ISP clock and
+// the USB adapter's latency make one port's pages slower than another's.
+typedef struct {
+    stk500_progress_t progress;
+    long long start_us;
+    long long prior_us;     // per unit from earlier runs, 0 if there were none
+} stk500_stage_t;
+
+static _Thread_local stk500_stage_t stk500_stage;
+
+static void stk500_stage_key(const stk500_progress_t *progress, char *key, size_t size) {
+    snprintf(key, size, "%s %s %s %s %d", stk500_port_key(), stk500_part ? stk500_part->id : "?",
+             progress->stage, progress->unit, stk500.window);
+}
+
+// The estimate blends the remembered per-unit time, weighted as
+// STK500_ETA_PRIOR_UNITS units, with what this run has measured so far
+static void stk500_stage_report(void) {
+    stk500_progress_t *progress = &stk500_stage.progress;
+    long long elapsed = serial.now() - stk500_stage.start_us;
+    progress->elapsed_s = elapsed / 1e6;
+    progress->bytes_per_s = progress->done > 0 && elapsed > 0 ? progress->bytes * 1e6 / elapsed : 0;
+
+    double per_unit = -1;
+    if (stk500_stage.prior_us > 0) {
+        per_unit = ((double)stk500_stage.prior_us * STK500_ETA_PRIOR_UNITS + elapsed) / (STK500_ETA_PRIOR_UNITS + progress->done);
+    } else if (progress->done > 0) {
+        per_unit = (double)elapsed / progress->done;
+    }
+    progress->eta_s = per_unit < 0 ? -1 : per_unit * (progress->total - progress->done) / 1e6;
+    if (stk500_progress_handler) stk500_progress_handler(progress);
+}
+
+static void stk500_stage_begin(const char *stage, const char *unit, int total) {
+    char key[192], value[32];
+    memset(&stk500_stage, 0, sizeof(stk500_stage));
+    stk500_stage.progress.stage = stage;
+    stk500_stage.progress.unit = unit;
+    stk500_stage.progress.total = total;
+    stk500_stage.start_us = serial.now();
+    stk500_stage_key(&stk500_stage.progress, key, sizeof(key));
+    if (stk500_load_keyed(STK500_STAGE_TIME_FILE, key, value, sizeof(value))) {
+        stk500_stage.prior_us = atoll(value);
+    }
+    stk500_stage.progress.calibrated = stk500_stage.prior_us > 0;
+    stk500_stage_report();
+}
+
+static void stk500_stage_advance(int units, unsigned int bytes) {
+    if (stk500_stage.progress.stage == NULL) return;
+    stk500_stage.progress.bytes += bytes;
+    if (units == 0) return;
+    stk500_stage.progress.done += units;
+    stk500_stage_report();
+}
+
+// Remembers the per-unit time of a stage that ran to completion, averaged with
+// the previous value so a single slow run does not throw off the next estimate
+static void stk500_stage_end(int ok) {
+    stk500_progress_t *progress = &stk500_stage.progress;
+    if (ok && progress->stage && progress->total > 0 && progress->done >= progress->total) {
+        long long per_unit = (serial.now() - stk500_stage.start_us) / progress->total;
+        if (stk500_stage.prior_us > 0) per_unit = (per_unit + stk500_stage.prior_us) / 2;
+        char key[192], value[32];
+        stk500_stage_key(progress, key, sizeof(key));
+        snprintf(value, sizeof(value), "%lld", per_unit);
+        stk500_save_keyed(STK500_STAGE_TIME_FILE, key, value);
+    }
+    progress->stage = NULL;
+}
+
+static size_t stk500_ring_count(const stk500_ring_t *ring) {
+    return ring->head - ring->tail;
+}
+
+static void stk500_ring_reset(stk500_ring_t *ring) {
+    ring->head = ring->tail = 0;
+}
+
+// Moves whatever the port has into the ring, waiting no later than `deadline`
+static int stk500_ring_fill(int fd, stk500_ring_t *ring, long long deadline) {
+    unsigned char buf[256];
+    size_t space = STK500_RING_SIZE - stk500_ring_count(ring);
+    if (space > sizeof(buf)) space = sizeof(buf);
+    if (space == 0) return 0;
+
+    int n = serial.read(fd, buf, space, deadline);
+    for (int i = 0; i < n; i++) {
+        ring->data[ring->head++ % STK500_RING_SIZE] = buf[i];
+    }
+    return n;
+}
+
+// Waits until a complete `len`-byte STK_INSYNC ... STK_OK frame has arrived or
+// the deadline passes. A leading byte other than STK_INSYNC fails immediately.
+static int stk500_read_frame(int fd, unsigned char *frame, size_t len, int timeout_us) {
+    long long start = serial.now();
+    long long deadline = start + timeout_us;
+    while (stk500_ring_count(&stk500_rx_ring) < len) {
+        if (stk500_ring_count(&stk500_rx_ring) > 0 && stk500_rx_ring.data[stk500_rx_ring.tail % STK500_RING_SIZE] != STK_INSYNC) {
+            break;
+        }
+        if (stk500_ring_fill(fd, &stk500_rx_ring, deadline) <= 0) {
+            break;
+        }
+    }
+    stk500_telemetry.wait_us += serial.now() - start;
+
+    size_t available = stk500_ring_count(&stk500_rx_ring);
+    if (available < len || stk500_rx_ring.data[stk500_rx_ring.tail % STK500_RING_SIZE] != STK_INSYNC ||
+        stk500_rx_ring.data[(stk500_rx_ring.tail + len - 1) % STK500_RING_SIZE] != STK_OK) {
+        stk500_ring_reset(&stk500_rx_ring);  // Out of sync, whatever is buffered belongs to no frame
+        return 0;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        frame[i] = stk500_rx_ring.data[stk500_rx_ring.tail++ % STK500_RING_SIZE];
+    }
+    stk500_telemetry.bytes_in += len;
+    return (int)len;
+}
+
+// Hands one or more whole frames to the driver in a single write()
+static int stk500_write_all(int fd, const unsigned char *buf, size_t len) {
+    long long start = serial.now();
+    int ok = serial.write(fd, buf, len);
+    stk500_telemetry.write_us += serial.now() - start;
+    if (ok) stk500_telemetry.bytes_out += len;
+    return ok;
+}
+
+// Discards anything still in flight from the programmer (boot banners, stale replies)
+static void stk500_drain_port(int fd) {
+    serial.drain(fd);
+    stk500_ring_reset(&stk500_rx_ring);
+}
+
+static const char *stk500_sysfs_root(void) {
+    const char *root = getenv(STK500_SYSFS_ROOT_ENV);
+    return root ? root : "";
+}
+
+static int stk500_read_sysfs_line(const char *dir, const char *attr, char *out, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, attr);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    int ok = fgets(out, size, fp) != NULL;
+    fclose(fp);
+    if (ok) out[strcspn(out, "\r\n")] = 0;
+    return ok;
+}
+
+static int stk500_rank_port(unsigned int vid, unsigned int pid) {
+    for (size_t i = 0; i < STK500_KNOWN_PROGRAMMERS; i++) {
+        if (stk500_known_programmers[i].vid == vid && (stk500_known_programmers[i].pid == 0 || stk500_known_programmers[i].pid == pid)) {
+            return stk500_known_programmers[i].rank;
+        }
+    }
+    return STK500_UNKNOWN_USB_RANK;
+}
+
+// Resolves /sys/class/tty/<name>/device and walks up to the USB device node that
+// carries idVendor/idProduct/serial. Returns 0 for ttys that are not USB.
+static int stk500_describe_tty(const char *name, stk500_port_t *port) {
+    char link[PATH_MAX], dir[PATH_MAX], value[STK500_SERIAL_NUMBER_LENGTH];
+    snprintf(link, sizeof(link), "%s%s/%s/device", stk500_sysfs_root(), STK500_SYSFS_TTY_CLASS, name);
+    if (realpath(link, dir) == NULL) {
+        return 0;
+    }
+
+    for (int depth = 0; depth < STK500_SYSFS_MAX_DEPTH; depth++) {
+        if (stk500_read_sysfs_line(dir, "idVendor", value, sizeof(value))) {
+            snprintf(port->name, STK500_PORT_NAME_LENGTH, "/dev/%s", name);
+            port->vid = strtoul(value, NULL, 16);
+            port->pid = stk500_read_sysfs_line(dir, "idProduct", value, sizeof(value)) ? strtoul(value, NULL, 16) : 0;
+            if (!stk500_read_sysfs_line(dir, "serial", port->serial, sizeof(port->serial))) {
+                port->serial[0] = 0;
+            }
+            port->rank = stk500_rank_port(port->vid, port->pid);
+            return 1;
+        }
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || slash == dir) break;
+        *slash = 0;
+    }
+    return 0;
+}
+
+static int stk500_compare_ports(const void *a, const void *b) {
+    const stk500_port_t *pa = a, *pb = b;
+    if (pa->rank != pb->rank) return pa->rank - pb->rank;
+    return strcmp(pa->name, pb->name);
+}
+
+static int stk500_matches_filter(const stk500_port_t *port, unsigned int vid, unsigned int pid) {
+    return (vid == 0 || port->vid == vid) && (pid == 0 || port->pid == pid);
+}
+
+// Linux: enumerate USB serial adapters from sysfs without opening anything.
+// Ports are ranked by known programmer IDs; vid/pid of 0 accept anything.
+static int stk500_enumerate_sysfs_ports(stk500_port_t ports[], unsigned int vid, unsigned int pid) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", stk500_sysfs_root(), STK500_SYSFS_TTY_CLASS);
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < STK500_MAX_PORTS) {
+        if (entry->d_name[0] == '.') continue;
+        if (stk500_describe_tty(entry->d_name, &ports[count]) && stk500_matches_filter(&ports[count], vid, pid)) {
+            count++;
+        }
+    }
+    closedir(dir);
+
+    qsort(ports, count, sizeof(stk500_port_t), stk500_compare_ports);
+    return count;
+}
+
+static int stk500_get_available_ports(stk500_port_t ports[], unsigned int vid, unsigned int pid) {
+    int count = 0;
+    memset(ports, 0, STK500_MAX_PORTS * sizeof(stk500_port_t));
+
+    if (IsWindows()) {
+        // Windows: Check COM1 through COM20
+        for (int i = 1; i <= 20 && count < STK500_MAX_PORTS; i++) {
+            snprintf(ports[count].name, STK500_PORT_NAME_LENGTH, "COM%d", i);
+            int fd = open(ports[count].name, O_RDWR | O_NONBLOCK);
+            if (fd >= 0) {
+                close(fd);
+                count++;
+            }
+        }
+    } else if (IsXnu()) {
+        // macOS: Check /dev/cu.* devices
+        DIR *dir = opendir("/dev");
+        if (dir) {
+            struct dirent *entry;
+            while ((entry = readdir(dir)) != NULL && count < STK500_MAX_PORTS) {
+                if (strncmp(entry->d_name, "cu.", 3) == 0) {
+                    snprintf(ports[count].name, STK500_PORT_NAME_LENGTH, "/dev/%s", entry->d_name);
+                    count++;
+                }
+            }
+            closedir(dir);
+        }
+    } else if (IsLinux()) {
+        // Linux: USB serial adapters from sysfs, known programmers first
+        count = stk500_enumerate_sysfs_ports(ports, vid, pid);
+    } else if (IsBsd()) {
+        // BSD: Check /dev/cuaU* devices
+        DIR *dir = opendir("/dev");
+        if (dir) {
+            struct dirent *entry;
+            while ((entry = readdir(dir)) != NULL && count < STK500_MAX_PORTS) {
+                if (strncmp(entry->d_name, "cuaU", 4) == 0) {
+                    snprintf(ports[count].name, STK500_PORT_NAME_LENGTH, "/dev/%s", entry->d_name);
+                    count++;
+                }
+            }
+            closedir(dir);
+        }
+    }
+
+    return count;
+}
+
+// Linux hotplug: blocks on an inotify watch of /dev until a tty appears that
+// sysfs describes as a matching USB serial adapter, or the timeout runs out
+static int stk500_wait_for_port(stk500_port_t *port, unsigned int vid, unsigned int pid, int timeout_ms) {
+    if (!IsLinux()) return 0;
+
+    int fd = inotify_init1(IN_NONBLOCK);
+    if (fd < 0) return 0;
+    if (inotify_add_watch(fd, "/dev", IN_CREATE | IN_ATTRIB) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    long long deadline = serial.now() + timeout_ms * 1000LL;
+    int found = 0;
+    while (!found) {
+        long long remaining = deadline - serial.now();
+        if (remaining <= 0) break;
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, (int)((remaining + 999) / 1000)) <= 0) break;
+
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len = read(fd, events, sizeof(events));
+        for (char *ptr = events; len > 0 && ptr < events + len && !found; ) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            if (event->len > 0 && strncmp(event->name, "tty", 3) == 0) {
+                found = stk500_describe_tty(event->name, port) && stk500_matches_filter(port, vid, pid);
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    close(fd);
+    return found;
+}
+
+static int stk500_send_command(int fd, unsigned char *cmd, size_t cmd_len, unsigned char *response, size_t resp_len) {
+    long long sent = serial.now();
+    int ok = stk500_write_all(fd, cmd, cmd_len) && stk500_read_frame(fd, response, resp_len, STK500_READ_TIMEOUT_US);
+    stk500_telemetry_record(cmd[0], sent, ok);
+    return ok;
+}
+
+static int stk500_sync_programmer(int fd) {
+    // The reset pulse was already given by the caller; just drop anything it printed
+    stk500_drain_port(fd);
+
+    unsigned char cmd[] = {STK_GET_SYNC, CRC_EOP};
+    unsigned char response[2];
+
+    for (int i = 0; i < STK500_SYNC_ATTEMPTS; i++) {
+        if (stk500_send_command(fd, cmd, sizeof(cmd), response, sizeof(response))) {
+            return 1;
+        }
+        stk500_drain_port(fd);
+    }
+    return 0;
+}
+
+// Stores the sign-on string (e.g. "AVR ISP") in version, NUL-terminated
+static int stk500_get_programmer_version(int fd, char version[STK500_SIGN_ON_LENGTH]) {
+    unsigned char cmd[] = {STK_GET_SIGN_ON, CRC_EOP};
+    unsigned char response[STK500_SIGN_ON_LENGTH];
+    if (stk500_send_command(fd, cmd, sizeof(cmd), response, sizeof(response)) <= 0) {
+        return 0;
+    }
+    memcpy(version, response + 1, STK500_SIGN_ON_LENGTH - 2);
+    version[STK500_SIGN_ON_LENGTH - 2] = 0;
+    return 1;
+}
+
+// Makes part the target; fails for parts whose flash this uploader cannot address
+static int stk500_select_part(const device_t *candidate) {
+    if (candidate == NULL || candidate->flash_page == 0 || candidate->flash_page > STK500_MAX_PAGE_SIZE ||
+        candidate->flash_size > STK500_MAX_FLASH_SIZE || candidate->flash_size / candidate->flash_page > STK500_MAX_PAGE_COUNT) {
+        return 0;
+    }
+    stk500_part = candidate;
+    stk500_page_size = stk500_part->flash_page;
+    stk500_flash_size = stk500_part->flash_size;
+    stk500_page_count = stk500_flash_size / stk500_page_size;
+    return 1;
+}
+
+static int stk500_set_device_parameters(int fd) {
+    // Descriptor layout of STK_SET_DEVICE; ArduinoISP only uses the sizes
+    unsigned char set_device_cmd[] = {
+        STK_SET_DEVICE,
+        stk500_part->stk500_devcode,
+        0x00,  // revision
+        0x00,  // prog type: both parallel and serial
+        0x01,  // full parallel interface
+        0x01,  // polling
+        0x01,  // self-timed
+        0x01,  // lock bytes
+        stk500_part->fuse_count,
+        0xFF,  // flash poll value 1
+        0xFF,  // flash poll value 2
+        0xFF,  // eeprom poll value 1
+        0xFF,  // eeprom poll value 2
+        (stk500_page_size >> 8) & 0xFF, stk500_page_size & 0xFF,
+        (stk500_part->eeprom_size >> 8) & 0xFF, stk500_part->eeprom_size & 0xFF,
+        (stk500_flash_size >> 24) & 0xFF, (stk500_flash_size >> 16) & 0xFF, (stk500_flash_size >> 8) & 0xFF, stk500_flash_size & 0xFF,
+        CRC_EOP
+    };
+    
+    unsigned char response[2];
+    return stk500_send_command(fd, set_device_cmd, sizeof(set_device_cmd), response, sizeof(response));
+}
+
+static int stk500_enter_program_mode(int fd) {
+    unsigned char cmd[] = {STK_ENTER_PROGMODE, CRC_EOP};
+    unsigned char response[2];
+    return stk500_send_command(fd, cmd, sizeof(cmd), response, sizeof(response));
+}
+
+static int stk500_leave_program_mode(int fd) {
+    unsigned char cmd[] = {STK_LEAVE_PROGMODE, CRC_EOP};
+    unsigned char response[2];
+    return stk500_send_command(fd, cmd, sizeof(cmd), response, sizeof(response));
+}
+
+static int stk500_universal_command(int fd, unsigned char cmd0, unsigned char cmd1, unsigned char cmd2, unsigned char cmd3) {
+    unsigned char cmd[] = {STK_UNIVERSAL, cmd0, cmd1, cmd2, cmd3, CRC_EOP};
+    unsigned char response[3];
+    return stk500_send_command(fd, cmd, sizeof(cmd), response, sizeof(response));
+}
+
+// Sends a universal (raw ISP) command and hands back the byte the target shifted out
+static int stk500_universal_read(int fd, unsigned char cmd0, unsigned char cmd1, unsigned char cmd2, unsigned char cmd3, unsigned char *result) {
+    unsigned char cmd[] = {STK_UNIVERSAL, cmd0, cmd1, cmd2, cmd3, CRC_EOP};
+    unsigned char response[3];
+    if (!stk500_send_command(fd, cmd, sizeof(cmd), response, sizeof(response))) {
+        return 0;
+    }
+    *result = response[1];
+    return 1;
+}
+
+static int stk500_read_signature(int fd, unsigned char sig[3]) {
+    for (int i = 0; i < 3; i++) {
+        if (!stk500_universal_read(fd, 0x30, 0x00, i, 0x00, &sig[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Reads the signature and switches to the part it names, re-sending the device
+// parameters if that part differs from the one progmode was entered with
+static int stk500_check_signature(int fd, unsigned char sig[3]) {
+    if (!stk500_read_signature(fd, sig)) {
+        return 0;
+    }
+    const device_t *found = device.by_signature(sig);
+    if (found == NULL) {
+        return 0;
+    }
+    if (found == stk500_part) {
+        return 1;
+    }
+    if (!stk500_select_part(found)) {
+        stk500_log("%s is not supported (%u byte flash, %u byte pages)\n", found->desc, found->flash_size, found->flash_page);
+        return 0;
+    }
+    return stk500_set_device_parameters(fd);
+}
+
+static size_t stk500_load_address_frame(unsigned char *cmd, unsigned int addr) {
+    cmd[0] = STK_LOAD_ADDRESS;
+    cmd[1] = (unsigned char)(addr & 0xFF);
+    cmd[2] = (unsigned char)((addr >> 8) & 0xFF);
+    cmd[3] = CRC_EOP;
+    return 4;
+}
+
+static size_t stk500_program_page_frame(unsigned char *cmd, stk500_page_t *page) {
+    cmd[0] = STK_PROG_PAGE;
+    cmd[1] = (page->length >> 8) & 0xFF;
+    cmd[2] = page->length & 0xFF;
+    cmd[3] = page->memtype;
+    memcpy(&cmd[4], page->data, page->length);
+    cmd[page->length + 4] = CRC_EOP;
+    return page->length + 5;
+}
+
+static int stk500_load_address(int fd, unsigned int addr) {
+    unsigned char cmd[4];
+    unsigned char response[2];
+    return stk500_send_command(fd, cmd, stk500_load_address_frame(cmd, addr), response, sizeof(response));
+}
+
+static void stk500_pipeline_deliver(stk500_pending_t *pending, const unsigned char *response) {
+    if (pending->out && pending->resp_len > 2) {
+        memcpy(pending->out, &response[1], pending->resp_len - 2);
+    }
+}
+
+// Matches the response of the oldest frame in flight. On a bad response the
+// pipeline resyncs, drops to stop-and-wait, and replays that frame and every
+// frame sent after it, since the programmer's state past the failure is unknown.
+// A page frame is replayed behind its own LOAD_ADDRESS: the one sent with it
+// may already have been answered, and the programmer has since moved on.
+static int stk500_pipeline_collect(stk500_pipeline_t *pipe) {
+    stk500_pending_t *oldest = &pipe->queue[pipe->head];
+    unsigned char response[STK500_READ_CHUNK + 2];
+    if (stk500_read_frame(pipe->fd, response, oldest->resp_len, STK500_READ_TIMEOUT_US)) {
+        stk500_telemetry_record(oldest->frame[0], oldest->sent_us, 1);
+        stk500_pipeline_deliver(oldest, response);
+        stk500_stage_advance(oldest->units, oldest->bytes);
+        pipe->head = (pipe->head + 1) % STK500_MAX_WINDOW;
+        pipe->count--;
+        return 1;
+    }
+
+    stk500_telemetry_record(oldest->frame[0], oldest->sent_us, 0);
+    stk500_log("Pipelined frame at 0x%04X failed, falling back to stop-and-wait\n", oldest->address);
+    pipe->window = 1;
+    if (!stk500_sync_programmer(pipe->fd)) {
+        return 0;
+    }
+    while (pipe->count > 0) {
+        stk500_pending_t *pending = &pipe->queue[pipe->head];
+        if (pending->reload && !stk500_load_address(pipe->fd, pending->load)) {
+            stk500_log("Frame at 0x%04X failed again\n", pending->address);
+            return 0;
+        }
+        if (!stk500_send_command(pipe->fd, pending->frame, pending->length, response, pending->resp_len)) {
+            stk500_log("Frame at 0x%04X failed again\n", pending->address);
+            return 0;
+        }
+        stk500_pipeline_deliver(pending, response);
+        stk500_stage_advance(pending->units, pending->bytes);
+        pipe->head = (pipe->head + 1) % STK500_MAX_WINDOW;
+        pipe->count--;
+    }
+    return 1;
+}
+
+// Frames still to send that go out in one write(). Taken from the current window,
+// which a failed frame drops to 1 part way through a send.
+static int stk500_pipeline_batch(const stk500_pipeline_t *pipe, int remaining) {
+    return remaining <= pipe->window ? remaining : 1;
+}
+
+// Sends `count` frames without waiting for their responses once they all fit in
+// the window, gathered into one write() so the driver sends them as one transfer.
+// A window smaller than `count` sends them one at a time; a window of 1 is plain
+// stop-and-wait. Response payloads, if any, are copied to each frame's `out`.
+static int stk500_pipeline_send(stk500_pipeline_t *pipe, const stk500_pending_t *frames, int count) {
+    for (int first = 0; first < count; ) {
+        while (pipe->count > 0 && pipe->count > pipe->window - stk500_pipeline_batch(pipe, count - first)) {
+            if (!stk500_pipeline_collect(pipe)) {
+                return 0;
+            }
+        }
+        int batch = stk500_pipeline_batch(pipe, count - first);
+
+        unsigned char buf[2 * sizeof(frames->frame)];
+        size_t length = 0;
+        long long now = serial.now();
+        for (int i = first; i < first + batch && i < count; i++) {
+            stk500_pending_t *pending = &pipe->queue[(pipe->head + pipe->count) % STK500_MAX_WINDOW];
+            *pending = frames[i];
+            pending->sent_us = now;
+            pipe->count++;
+            memcpy(&buf[length], frames[i].frame, frames[i].length);
+            length += frames[i].length;
+        }
+
+        if (!stk500_write_all(pipe->fd, buf, length)) {
+            return 0;
+        }
+        first += batch;
+        if (pipe->window == 1 && !stk500_pipeline_collect(pipe)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int stk500_pipeline_flush(stk500_pipeline_t *pipe) {
+    while (pipe->count > 0) {
+        if (!stk500_pipeline_collect(pipe)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Queues one page write, which counts `units` toward the stage once answered
+static int stk500_pipeline_program_page(stk500_pipeline_t *pipe, stk500_page_t *page, int units) {
+    stk500_pending_t frames[2] = {
+        { .resp_len = 2, .address = page->address },
+        { .resp_len = 2, .address = page->address, .units = units, .bytes = page->length,
+          .reload = 1, .load = page->address }
+    };
+    frames[0].length = stk500_load_address_frame(frames[0].frame, page->address);
+    frames[1].length = stk500_program_page_frame(frames[1].frame, page);
+    return stk500_pipeline_send(pipe, frames, 2);
+}
+
+static size_t stk500_read_page_frame(unsigned char *cmd, size_t len, char memtype) {
+    cmd[0] = STK_READ_PAGE;
+    cmd[1] = (len >> 8) & 0xFF;
+    cmd[2] = len & 0xFF;
+    cmd[3] = memtype;
+    cmd[4] = CRC_EOP;
+    return 5;
+}
+
+// Queues a read of `len` bytes at byte address `addr` of flash ('F') or EEPROM ('E');
+// the data lands in `out`, and `units` count toward the stage once it does.
+// ArduinoISP takes a word address for both memories.
+static int stk500_pipeline_read_page(stk500_pipeline_t *pipe, char memtype, unsigned int addr, size_t len, unsigned char *out, int units) {
+    stk500_pending_t frames[2] = {
+        { .resp_len = 2, .address = addr },
+        { .resp_len = len + 2, .address = addr, .out = out, .units = units, .bytes = len,
+          .reload = 1, .load = addr / 2 }
+    };
+    frames[0].length = stk500_load_address_frame(frames[0].frame, addr / 2);
+    frames[1].length = stk500_read_page_frame(frames[1].frame, len, memtype);
+    return stk500_pipeline_send(pipe, frames, 2);
+}
+
+static int stk500_load_hex_file(const char *filename, stk500_image_t *image) {
+    if (hex.load(filename, image) != 0) {
+        stk500_log("Failed to load %s: %s\n", filename, hex.error());
+        return 0;
+    }
+    return 1;
+}
+
+static int stk500_page_is_blank(const stk500_image_t *image, int page) {
+    for (int i = 0; i < stk500_page_size; i++) {
+        if (image->data[page * stk500_page_size + i] != 0xFF) return 0;
+    }
+    return 1;
+}
+
+static int stk500_chip_erase(int fd) {
+    // ArduinoISP ignores STK_CHIP_ERASE; the erase goes out as a universal command
+    if (!stk500_universal_command(fd, 0xAC, 0x80, 0x00, 0x00)) {
+        return 0;
+    }
+    usleep(stk500_part->chip_erase_delay ? stk500_part->chip_erase_delay : STK500_CHIP_ERASE_DELAY_US);
+    return 1;
+}
+
+static int stk500_read_flash(int fd, stk500_image_t *chip, int window) {
+    stk500_pipeline_t pipe = { .fd = fd, .window = window, .head = 0, .count = 0 };
+    stk500_stage_begin("READ", "pages", stk500_page_count);
+    for (unsigned int addr = 0; addr < stk500_flash_size; addr += STK500_READ_CHUNK) {
+        if (!stk500_pipeline_read_page(&pipe, 'F', addr, STK500_READ_CHUNK, &chip->data[addr], STK500_READ_CHUNK / stk500_page_size)) {
+            stk500_log("Failed to read flash at 0x%04X\n", addr);
+            stk500_stage_end(0);
+            return 0;
+        }
+    }
+    if (!stk500_pipeline_flush(&pipe)) {
+        stk500_log("Failed to read flash\n");
+        stk500_stage_end(0);
+        return 0;
+    }
+    stk500_stage_end(1);
+    chip->top = stk500_flash_size;
+    return 1;
+}
+
+// One cache file per programmer and part, so gang ports never share (or race
+// on) a file. The port key becomes part of the name with anything but letters
+// and digits replaced, e.g. .cache/flash/1e930b-_dev_ttyUSB0.bin
+static void stk500_flash_cache_path(const unsigned char sig[3], char *path, size_t size) {
+    char key[STK500_SERIAL_NUMBER_LENGTH];
+    snprintf(key, sizeof(key), "%s", stk500_port_key());
+    for (char *c = key; *c; c++) {
+        if (!isalnum((unsigned char)*c)) *c = '_';
+    }
+    snprintf(path, size, "%s/%02x%02x%02x-%s.bin", STK500_FLASH_CACHE_DIR, sig[0], sig[1], sig[2], key);
+}
+
+static int stk500_load_flash_cache(const unsigned char sig[3], stk500_image_t *chip) {
+    char path[PATH_MAX];
+    stk500_flash_cache_path(sig, path, sizeof(path));
+    pthread_mutex_lock(&stk500_cache_lock);
+    FILE *fp = fopen(path, "rb");
+    int ok = fp && fread(chip->data, 1, stk500_flash_size, fp) == stk500_flash_size;
+    if (fp) fclose(fp);
+    pthread_mutex_unlock(&stk500_cache_lock);
+    if (!ok) {
+        return 0;
+    }
+    chip->top = stk500_flash_size;
+    return ok;
+}
+
+// Remembers what was just written so the next cached diff needs no full readback
+static void stk500_save_flash_cache(const unsigned char sig[3], const stk500_image_t *image) {
+    char path[PATH_MAX];
+    mkdir(".cache", 0755);
+    mkdir(STK500_FLASH_CACHE_DIR, 0755);
+    stk500_flash_cache_path(sig, path, sizeof(path));
+    pthread_mutex_lock(&stk500_cache_lock);
+    FILE *fp = fopen(path, "wb");
+    if (fp) {
+        fwrite(image->data, 1, stk500_flash_size, fp);
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&stk500_cache_lock);
+}
+
+static int stk500_page_differs(const stk500_image_t *image, const stk500_image_t *chip, int page) {
+    return memcmp(&image->data[page * stk500_page_size], &chip->data[page * stk500_page_size], stk500_page_size) != 0;
+}
+
+// ISP page writes only clear bits; a page can be rewritten in place when the new
+// content needs no 0 -> 1 transition, otherwise only a chip erase will do
+static int stk500_page_needs_erase(const stk500_image_t *image, const stk500_image_t *chip, int page) {
+    for (int i = 0; i < stk500_page_size; i++) {
+        unsigned char want = image->data[page * stk500_page_size + i];
+        if ((chip->data[page * stk500_page_size + i] & want) != want) return 1;
+    }
+    return 0;
+}
+
+static int stk500_write_pages(int fd, const stk500_image_t *image, const unsigned char *dirty, int window) {
+    stk500_pipeline_t pipe = { .fd = fd, .window = window, .head = 0, .count = 0 };
+    int total = 0;
+    for (int page = 0; page < stk500_page_count; page++) {
+        total += dirty[page];
+    }
+    stk500_stage_begin("FLASH", "pages", total);
+    for (int page = 0; page < stk500_page_count; page++) {
+        if (!dirty[page]) {
+            continue;
+        }
+        
+        stk500_page_t current_page;
+        current_page.address = page * stk500_page_size / 2;  // Word address
+        current_page.length = stk500_page_size;
+        current_page.memtype = 'F';
+        memcpy(current_page.data, &image->data[page * stk500_page_size], stk500_page_size);
+        
+        if (!stk500_pipeline_program_page(&pipe, &current_page, 1)) {
+            stk500_log("Failed to program page at address 0x%04X\n", current_page.address);
+            stk500_stage_end(0);
+            return 0;
+        }
+    }
+    
+    if (!stk500_pipeline_flush(&pipe)) {
+        stk500_log("Failed to complete pipelined programming\n");
+        stk500_stage_end(0);
+        return 0;
+    }
+    stk500_stage_end(1);
+    return 1;
+}
+
+// Reads the pages marked in `wanted` into `readback` at their own addresses,
+// coalescing neighbours into STK500_READ_CHUNK-sized STK_READ_PAGE requests
+// that are pipelined like the writes. Returns 1 on success.
+static int stk500_read_pages(int fd, const unsigned char *wanted, unsigned char *readback, int window, const char *stage) {
+    stk500_pipeline_t pipe = { .fd = fd, .window = window, .head = 0, .count = 0 };
+    int total = 0;
+    for (int page = 0; page < stk500_page_count; page++) {
+        total += wanted[page];
+    }
+    stk500_stage_begin(stage, "pages", total);
+    
+    for (int page = 0; page < stk500_page_count; ) {
+        if (!wanted[page]) {
+            page++;
+            continue;
+        }
+        int first = page;
+        while (page < stk500_page_count && wanted[page] && (page - first + 1) * stk500_page_size <= STK500_READ_CHUNK) {
+            page++;
+        }
+        unsigned int addr = first * stk500_page_size;
+        size_t len = (page - first) * stk500_page_size;
+        if (!stk500_pipeline_read_page(&pipe, 'F', addr, len, &readback[addr], page - first)) {
+            stk500_stage_end(0);
+            return 0;
+        }
+    }
+    if (!stk500_pipeline_flush(&pipe)) {
+        stk500_stage_end(0);
+        return 0;
+    }
+    stk500_stage_end(1);
+    return 1;
+}
+
+// Reads back exactly the pages that were written. Returns -1 when everything
+// matches, the first mismatching byte address otherwise, or -2 if the readback
+// itself failed.
+static int stk500_verify_pages(int fd, const stk500_image_t *image, const unsigned char *dirty, int window) {
+    unsigned char *readback = malloc(stk500_flash_size);
+    if (readback == NULL) {
+        return -2;
+    }
+    if (!stk500_read_pages(fd, dirty, readback, window, "VERIFY")) {
+        free(readback);
+        return -2;
+    }
+    
+    int mismatch = -1;
+    for (int page = 0; page < stk500_page_count && mismatch < 0; page++) {
+        if (!dirty[page]) continue;
+        for (int i = 0; i < stk500_page_size; i++) {
+            unsigned int addr = page * stk500_page_size + i;
+            if (readback[addr] != image->data[addr]) {
+                mismatch = addr;
+                break;
+            }
+        }
+    }
+    free(readback);
+    return mismatch;
+}
+
+// In cached mode the pages about to be rewritten are read back, so a chip that
+// was reprogrammed behind our back is caught before we trust the cache. The cache
+// is kept per programmer, and two more pages are sampled to catch a different
+// board on it: the vector table and the image's last page, which almost any
+// two builds disagree on. Swapping boards that pass both is what --diff is for.
+static int stk500_confirm_cached_pages(int fd, const stk500_image_t *image, const stk500_image_t *chip, int window) {
+    unsigned char wanted[STK500_MAX_PAGE_COUNT];
+    int last = image->top > 0 ? (int)((image->top - 1) / stk500_page_size) : 0;
+    for (int page = 0; page < stk500_page_count; page++) {
+        wanted[page] = page == 0 || page == last || stk500_page_differs(image, chip, page);
+    }
+    unsigned char *readback = malloc(stk500_flash_size);
+    if (readback == NULL) {
+        return 0;
+    }
+    int ok = stk500_read_pages(fd, wanted, readback, window, "CONFIRM");
+    for (int page = 0; ok && page < stk500_page_count; page++) {
+        if (wanted[page] && memcmp(&readback[page * stk500_page_size], &chip->data[page * stk500_page_size], stk500_page_size) != 0) {
+            ok = 0;
+        }
+    }
+    free(readback);
+    return ok;
+}
+
+static void stk500_remove_flash_cache(const unsigned char sig[3]) {
+    char path[PATH_MAX];
+    stk500_flash_cache_path(sig, path, sizeof(path));
+    remove(path);
+}
+
+
+static int stk500_load_session(stk500_session_t *state) {
+    memset(state, 0, sizeof(*state));
+    FILE *fp = fopen(STK500_SESSION_CACHE_FILE, "r");
+    if (!fp) return 0;
+
+    char line[128];
+    unsigned int sig[3];
+    int fields = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (strncmp(line, "port ", 5) == 0) {
+            snprintf(state->port, sizeof(state->port), "%s", line + 5);
+            fields++;
+        } else if (strncmp(line, "serial ", 7) == 0) {
+            snprintf(state->serial, sizeof(state->serial), "%s", line + 7);
+        } else if (sscanf(line, "id %x:%x", &state->vid, &state->pid) == 2) {
+            // USB IDs are informational; --id filtering uses them
+        } else if (strncmp(line, "version ", 8) == 0) {
+            snprintf(state->version, sizeof(state->version), "%s", line + 8);
+        } else if (sscanf(line, "signature %x %x %x", &sig[0], &sig[1], &sig[2]) == 3) {
+            for (int i = 0; i < 3; i++) state->signature[i] = sig[i];
+            fields++;
+        }
+    }
+    fclose(fp);
+    state->valid = fields == 2;
+    return state->valid;
+}
+
+static void stk500_save_session(const stk500_session_t *state) {
+    mkdir(".cache", 0755);
+    pthread_mutex_lock(&stk500_cache_lock);
+    FILE *fp = fopen(STK500_SESSION_CACHE_FILE, "w");
+    if (fp) {
+        fprintf(fp, "port %s\n", state->port);
+        if (state->serial[0]) fprintf(fp, "serial %s\n", state->serial);
+        if (state->vid) fprintf(fp, "id %04x:%04x\n", state->vid, state->pid);
+        if (state->version[0]) fprintf(fp, "version %s\n", state->version);
+        fprintf(fp, "signature %02x %02x %02x\n", state->signature[0], state->signature[1], state->signature[2]);
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&stk500_cache_lock);
+}
+
+// Goes straight to the port of the last good session. The port is looked up by USB
+// serial number when enumeration can provide one, since the tty name may have moved.
+// Because serial.open() leaves DTR up on close, the board has usually not been reset and
+// ArduinoISP answers at once; only if it stays silent is it reset and waited for.
+static int stk500_resume_session(stk500_session_t *state, unsigned int vid, unsigned int pid) {
+    if ((vid && state->vid != vid) || (pid && state->pid != pid)) {
+        return -1;
+    }
+
+    if (state->serial[0]) {
+        stk500_port_t ports[STK500_MAX_PORTS];
+        int count = IsLinux() ? stk500_enumerate_sysfs_ports(ports, vid, pid) : 0;
+        for (int i = 0; i < count; i++) {
+            if (strcmp(ports[i].serial, state->serial) == 0) {
+                snprintf(state->port, sizeof(state->port), "%s", ports[i].name);
+                break;
+            }
+        }
+    }
+
+    int fd = serial.open(state->port, STK500_BAUD);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unsigned char cmd[] = {STK_GET_SYNC, CRC_EOP};
+    unsigned char response[2];
+    stk500_drain_port(fd);
+    for (int i = 0; i < STK500_QUICK_SYNC_ATTEMPTS; i++) {
+        if (stk500_send_command(fd, cmd, sizeof(cmd), response, sizeof(response))) {
+            return fd;
+        }
+        stk500_drain_port(fd);
+    }
+
+    serial.reset(&fd, 1);
+    usleep(STK500_INIT_DELAY_US);
+    if (stk500_sync_programmer(fd)) {
+        return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+// Opens every candidate at once, resets them with a single pulse, waits one boot
+// delay and then races GET_SYNC on all of them through serial.wait_any(). The first port to
+// answer STK_INSYNC/STK_OK is returned (its index in *index); the rest are closed.
+static int stk500_probe_ports(stk500_port_t ports[], int port_count, int *index) {
+    int fds[STK500_MAX_PORTS];
+    int owners[STK500_MAX_PORTS];
+    unsigned char last[STK500_MAX_PORTS][2];
+    int count = 0;
+    
+    for (int i = 0; i < port_count && count < STK500_MAX_PORTS; i++) {
+        int fd = serial.open(ports[i].name, STK500_BAUD);
+        if (fd < 0) {
+            stk500_log("Failed to open %s: %s\n", ports[i].name, strerror(errno));
+            continue;
+        }
+        fds[count] = fd;
+        owners[count] = i;
+        count++;
+    }
+    if (count == 0) {
+        return -1;
+    }
+    
+    stk500_log("Resetting %d ports...\n", count);
+    serial.reset(fds, count);
+    usleep(STK500_INIT_DELAY_US);
+    
+    unsigned char cmd[] = {STK_GET_SYNC, CRC_EOP};
+    int winner = -1;
+    for (int attempt = 0; attempt < STK500_SYNC_ATTEMPTS && winner < 0; attempt++) {
+        for (int i = 0; i < count; i++) {
+            unsigned char junk[128];
+            while (serial.read(fds[i], junk, sizeof(junk), 0) > 0) {
+                // Discard boot output and stale replies
+            }
+            last[i][0] = last[i][1] = 0;
+            stk500_write_all(fds[i], cmd, sizeof(cmd));
+        }
+        
+        long long deadline = serial.now() + STK500_READ_TIMEOUT_US;
+        while (winner < 0) {
+            if (serial.wait_any(fds, count, deadline) < 0) {
+                break;
+            }
+            
+            // Take what every port has, so one chatty port cannot starve the rest
+            for (int i = 0; i < count && winner < 0; i++) {
+                unsigned char buf[64];
+                int n = serial.read(fds[i], buf, sizeof(buf), 0);
+                for (int j = 0; j < n; j++) {
+                    last[i][0] = last[i][1];
+                    last[i][1] = buf[j];
+                    if (last[i][0] == STK_INSYNC && last[i][1] == STK_OK) {
+                        winner = i;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (i != winner) close(fds[i]);
+    }
+    if (winner < 0) {
+        return -1;
+    }
+    *index = owners[winner];
+    return fds[winner];
+}
+
+static int stk500_set_parameter(int fd, unsigned char parameter, unsigned char value) {
+    unsigned char cmd[] = {STK_SET_PARAMETER, parameter, value, CRC_EOP};
+    unsigned char response[2];
+    return stk500_send_command(fd, cmd, sizeof(cmd), response, sizeof(response));
+}
+
+// The ISP clock that worked is kept per programmer and target signature
+static void stk500_isp_clock_key(const unsigned char sig[3], char *key, size_t size) {
+    snprintf(key, size, "%02x%02x%02x %s", sig[0], sig[1], sig[2], stk500_port_key());
+}
+
+static int stk500_load_isp_clock(const unsigned char sig[3]) {
+    char key[128], value[32];
+    stk500_isp_clock_key(sig, key, sizeof(key));
+    return stk500_load_keyed(STK500_ISP_CLOCK_FILE, key, value, sizeof(value)) ? atoi(value) : STK500_SCK_UNKNOWN;
+}
+
+static void stk500_save_isp_clock(const unsigned char sig[3], int clock) {
+    char key[128], value[32];
+    stk500_isp_clock_key(sig, key, sizeof(key));
+    snprintf(value, sizeof(value), "%d", clock);
+    stk500_save_keyed(STK500_ISP_CLOCK_FILE, key, value);
+}
+
+static int stk500_enter_and_identify(int fd, unsigned char sig[3]) {
+    if (!stk500_set_device_parameters(fd) || !stk500_enter_program_mode(fd)) {
+        return 0;
+    }
+    stk500_in_progmode = 1;
+    if (stk500_check_signature(fd, sig)) {
+        return 1;
+    }
+    stk500_leave_program_mode(fd);
+    stk500_in_progmode = 0;
+    return 0;
+}
+
+// Enters progmode at the fastest ISP clock that yields a known signature. The search
+// starts at the clock remembered for this target (or the top of the ladder) and
+// steps down on failure. Firmware that does not know STK_SET_PARAMETER (ArduinoISP
+// answers NOSYNC and misreads the rest of the frame) is resynced and used at its
+// fixed clock, and remembered as such so later sessions skip the probe.
+static int stk500_enter_adaptive(int fd, const unsigned char *assumed, unsigned char sig[3]) {
+    int remembered = assumed ? stk500_load_isp_clock(assumed) : STK500_SCK_UNKNOWN;
+    if (remembered == STK500_SCK_UNSUPPORTED) {
+        stk500_isp_clock = STK500_SCK_UNSUPPORTED;
+        return stk500_enter_and_identify(fd, sig);
+    }
+
+    size_t step = 0;
+    while (remembered >= 0 && step + 1 < STK500_SCK_STEPS && stk500_sck_ladder[step] < remembered) {
+        step++;
+    }
+    for (; step < STK500_SCK_STEPS; step++) {
+        if (!stk500_set_parameter(fd, STK500_PARM_SCK_DURATION, stk500_sck_ladder[step])) {
+            stk500_drain_port(fd);
+            if (!stk500_sync_programmer(fd)) {
+                return 0;
+            }
+            stk500_isp_clock = STK500_SCK_UNSUPPORTED;
+            return stk500_enter_and_identify(fd, sig);
+        }
+        if (stk500_enter_and_identify(fd, sig)) {
+            stk500_isp_clock = stk500_sck_ladder[step];
+            return 1;
+        }
+        stk500_log("No valid signature at SCK duration %d, slowing down\n", stk500_sck_ladder[step]);
+    }
+    return 0;
+}
+
+// Syncs with the programmer on fd and enters programming mode on the target, whose
+// signature then selects the device entry. Takes over fd as the session's port.
+static int stk500_begin(int fd, const char *part_name, const stk500_session_t *previous) {
+    stk500.fd = fd;
+    if (!stk500_sync_programmer(fd)) {
+        stk500_log("Failed to sync with programmer\n");
+        return stk500_close(0);
+    }
+    
+    // Progmode needs page and memory sizes before the signature can be read, so start
+    // from the part the last session saw (or the requested one) and correct it after
+    const device_t *assumed = previous ? device.by_signature(previous->signature) : NULL;
+    if (assumed == NULL) assumed = device.by_name(part_name);
+    if (!stk500_select_part(assumed)) {
+        stk500_log("Unknown part %s (device table from %s)\n", part_name, device.conf_path());
+        return stk500_close(0);
+    }
+    
+    unsigned char sig[3] = {0};
+    if (!stk500_enter_adaptive(fd, assumed->signature, sig)) {
+        stk500_log("Device signature %02X %02X %02X is not a supported part\n", sig[0], sig[1], sig[2]);
+        return stk500_close(0);
+    }
+    stk500.part = stk500_part;
+    stk500_log("Target %s: %u bytes of flash in %d byte pages\n", stk500_part->desc, stk500_flash_size, stk500_page_size);
+    if (stk500_isp_clock >= 0) {
+        stk500_log("ISP clock: SCK duration %d\n", stk500_isp_clock);
+    }
+    if (previous && memcmp(previous->signature, sig, 3) != 0) {
+        stk500_log("Target changed since the last session (was %02X %02X %02X)\n",
+                   previous->signature[0], previous->signature[1], previous->signature[2]);
+    }
+    memcpy(stk500_session.signature, sig, 3);
+    return 1;
+}
+
+// Finds the programmer (the remembered port first, then a scan) and begins a session on it
+static int stk500_connect(const char *part_name, unsigned int vid, unsigned int pid, int rescan, int wait_ms) {
+    int fd = -1;
+    stk500_telemetry_reset();
+    stk500_session_t previous;
+    memset(&previous, 0, sizeof(previous));
+    if (!rescan && stk500_load_session(&stk500_session)) {
+        previous = stk500_session;
+        fd = stk500_resume_session(&stk500_session, vid, pid);
+        if (fd >= 0) {
+            stk500_log("Resumed %s (%s) on %s\n", stk500_session.version[0] ? stk500_session.version : "programmer",
+                       stk500_session.serial[0] ? stk500_session.serial : "no serial", stk500_session.port);
+        } else {
+            stk500_log("Last session's port %s did not answer, scanning\n", stk500_session.port);
+        }
+    }
+
+    if (fd < 0) {
+        stk500_port_t ports[STK500_MAX_PORTS];
+        int port_count = stk500_get_available_ports(ports, vid, pid);
+        
+        stk500_log("Found %d potential serial ports\n", port_count);
+        for (int i = 0; i < port_count; i++) {
+            if (ports[i].vid) {
+                stk500_log("  %s  %04x:%04x  %s\n", ports[i].name, ports[i].vid, ports[i].pid, ports[i].serial);
+            }
+        }
+        
+        int index;
+        fd = stk500_probe_ports(ports, port_count, &index);
+        while (fd < 0 && wait_ms > 0) {
+            stk500_log("Waiting for a programmer to be plugged in...\n");
+            if (!stk500_wait_for_port(&ports[0], vid, pid, wait_ms)) {
+                break;
+            }
+            usleep(STK500_RESET_PULSE_US);  // Let udev finish setting up the node
+            fd = stk500_probe_ports(ports, 1, &index);
+        }
+        if (fd < 0) {
+            stk500_log("No ArduinoISP answered on any port\n");
+            return 0;
+        }
+        stk500_log("ArduinoISP found on %s\n", ports[index].name);
+
+        memset(&stk500_session, 0, sizeof(stk500_session));
+        snprintf(stk500_session.port, sizeof(stk500_session.port), "%s", ports[index].name);
+        snprintf(stk500_session.serial, sizeof(stk500_session.serial), "%s", ports[index].serial);
+        stk500_session.vid = ports[index].vid;
+        stk500_session.pid = ports[index].pid;
+        stk500_get_programmer_version(fd, stk500_session.version);
+    }
+    stk500_remember = 1;
+    return stk500_begin(fd, part_name, previous.valid ? &previous : NULL);
+}
+
+// Opens one given port, resets the board behind it and enters programming mode.
+// Unlike connect nothing is discovered and the session file is left alone, so
+// every thread can hold a programmer of its own (upload --gang).
+static int stk500_open(const stk500_port_t *port, const char *part_name) {
+    stk500_telemetry_reset();
+    int fd = serial.open(port->name, STK500_BAUD);
+    if (fd < 0) {
+        stk500_log("Cannot open %s\n", port->name);
+        return 0;
+    }
+    serial.reset(&fd, 1);
+    usleep(STK500_INIT_DELAY_US);
+
+    memset(&stk500_session, 0, sizeof(stk500_session));
+    snprintf(stk500_session.port, sizeof(stk500_session.port), "%s", port->name);
+    snprintf(stk500_session.serial, sizeof(stk500_session.serial), "%s", port->serial);
+    stk500_session.vid = port->vid;
+    stk500_session.pid = port->pid;
+    stk500_remember = 0;
+    if (stk500_sync_programmer(fd)) {
+        stk500_get_programmer_version(fd, stk500_session.version);
+    }
+    return stk500_begin(fd, part_name, NULL);
+}
+
+static const device_fuse_t *stk500_find_fuse(const char *name) {
+    const device_fuse_t *fuse = stk500_part ? device.fuse(stk500_part, name) : NULL;
+    if (stk500.fd < 0 || fuse == NULL || fuse->read[0] == 0) {
+        stk500_log("%s has no fuse %s\n", stk500_part ? stk500_part->desc : "Target", name);
+        return NULL;
+    }
+    return fuse;
+}
+
+static int stk500_read_fuse(const char *name, unsigned char *value) {
+    const device_fuse_t *fuse = stk500_find_fuse(name);
+    if (fuse == NULL) {
+        return 0;
+    }
+    if (!stk500_universal_read(stk500.fd, fuse->read[0], fuse->read[1], fuse->read[2], fuse->read[3], value)) {
+        stk500_log("Failed to read %s\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+// Reads the fuse first and only programs it when an implemented bit differs, so
+// the usual case costs one universal command and no fuse wear. After a write the
+// fuse is polled until it reads back the new value.
+static int stk500_write_fuse(const char *name, unsigned char value) {
+    const device_fuse_t *fuse = stk500_find_fuse(name);
+    unsigned char current;
+    if (fuse == NULL || !stk500_read_fuse(name, &current)) {
+        return 0;
+    }
+    if ((current & fuse->bitmask) == (value & fuse->bitmask)) {
+        return 1;
+    }
+    if (fuse->write[0] == 0) {
+        stk500_log("%s of %s cannot be written over ISP\n", name, stk500_part->desc);
+        return 0;
+    }
+
+    stk500_log("Writing %s: 0x%02X -> 0x%02X\n", name, current, value);
+    if (!stk500_universal_command(stk500.fd, fuse->write[0], fuse->write[1], fuse->write[2], fuse->write[3] | (value & fuse->bitmask))) {
+        stk500_log("Failed to write %s\n", name);
+        return 0;
+    }
+    long long deadline = serial.now() + STK500_FUSE_TIMEOUT_US;
+    do {
+        usleep(STK500_FUSE_POLL_US);
+        if (!stk500_read_fuse(name, &current)) {
+            return 0;
+        }
+        if ((current & fuse->bitmask) == (value & fuse->bitmask)) {
+            return 1;
+        }
+    } while (serial.now() < deadline);
+    stk500_log("%s reads 0x%02X after writing 0x%02X\n", name, current, value);
+    return 0;
+}
+
+// Programs an image that was loaded once and may be shared between threads.
+// on_chip is scratch for the differential modes; without it the upload is full.
+static int stk500_write_image(const stk500_image_t *image, stk500_image_t *on_chip, stk500_mode_t mode, int verify) {
+    int fd = stk500.fd;
+    int window = stk500.window;
+    if (fd < 0) {
+        return 0;
+    }
+    if (image->top > stk500_flash_size) {
+        stk500_log("Image does not fit %s (%u > %u bytes)\n", stk500_part->desc, image->top, stk500_flash_size);
+        return 0;
+    }
+    const unsigned char *sig = stk500_session.signature;
+    
+    unsigned char dirty[STK500_MAX_PAGE_COUNT];
+    int pages_written = 0;
+    int in_place = 0;
+    
+    if (mode != STK500_FULL && on_chip) {
+        int have_chip = 0;
+        if (mode == STK500_CACHED && stk500_load_flash_cache(sig, on_chip)) {
+            have_chip = stk500_confirm_cached_pages(fd, image, on_chip, window);
+            if (!have_chip) stk500_log("Flash cache is stale, reading the device back\n");
+        }
+        if (!have_chip) {
+            have_chip = stk500_read_flash(fd, on_chip, window);
+        }
+        
+        if (have_chip) {
+            in_place = 1;
+            for (int page = 0; page < stk500_page_count; page++) {
+                dirty[page] = stk500_page_differs(image, on_chip, page);
+                pages_written += dirty[page];
+                if (dirty[page] && stk500_page_needs_erase(image, on_chip, page)) {
+                    in_place = 0;
+                }
+            }
+            if (!in_place) {
+                stk500_log("Changed pages need erasing, falling back to a full upload\n");
+            }
+        }
+    }
+    
+    if (!in_place) {
+        // After a chip erase every page reads 0xFF, so blank pages need no write at all
+        if (!stk500_chip_erase(fd)) {
+            stk500_log("Failed to erase chip\n");
+            return 0;
+        }
+        pages_written = 0;
+        for (int page = 0; page < stk500_page_count; page++) {
+            dirty[page] = !stk500_page_is_blank(image, page);
+            pages_written += dirty[page];
+        }
+    }
+    
+    if (!stk500_write_pages(fd, image, dirty, window)) {
+        return 0;
+    }
+    
+    if (verify) {
+        int mismatch = stk500_verify_pages(fd, image, dirty, window);
+        if (mismatch != -1) {
+            if (mismatch >= 0) {
+                stk500_log("Verification failed at address 0x%04X\n", mismatch);
+            } else {
+                stk500_log("Verification readback failed\n");
+            }
+            stk500_remove_flash_cache(sig);
+            return 0;
+        }
+        stk500_log("Verified %d pages\n", pages_written);
+    }
+    stk500_save_flash_cache(sig, image);
+    
+    stk500_log("Successfully programmed %d of %d pages (%u byte image%s)\n", pages_written, stk500_page_count, image->top,
+               in_place ? ", differential" : "");
+    return 1;
+}
+
+static int stk500_flash_image(const stk500_image_t *image, stk500_mode_t mode, int verify) {
+    stk500_image_t *on_chip = mode == STK500_FULL ? NULL : malloc(sizeof(stk500_image_t));
+    int ok = stk500_write_image(image, on_chip, mode, verify);
+    free(on_chip);
+    return ok;
+}
+
+static int stk500_flash(const char *filename, stk500_mode_t mode, int verify) {
+    stk500_image_t *image = malloc(sizeof(stk500_image_t));
+    int ok = image && stk500.fd >= 0 && stk500_load_hex_file(filename, image) && stk500_flash_image(image, mode, verify);
+    free(image);
+    return ok;
+}
+
+// Reads `size` bytes of EEPROM from address 0 with pipelined STK_READ_PAGE requests
+static int stk500_read_eeprom(int fd, unsigned char *data, unsigned int size, int window) {
+    stk500_pipeline_t pipe = { .fd = fd, .window = window, .head = 0, .count = 0 };
+    stk500_stage_begin("READ", "bytes", size);
+    for (unsigned int addr = 0; addr < size; addr += STK500_READ_CHUNK) {
+        size_t len = size - addr < STK500_READ_CHUNK ? size - addr : STK500_READ_CHUNK;
+        if (!stk500_pipeline_read_page(&pipe, 'E', addr, len, &data[addr], len)) {
+            stk500_log("Failed to read EEPROM at 0x%04X\n", addr);
+            stk500_stage_end(0);
+            return 0;
+        }
+    }
+    if (!stk500_pipeline_flush(&pipe)) {
+        stk500_log("Failed to read EEPROM\n");
+        stk500_stage_end(0);
+        return 0;
+    }
+    stk500_stage_end(1);
+    return 1;
+}
+
+// Narrows [*first, *last) to the bytes that differ from the chip, starting at an even
+// address because the load address is a word address. Returns 0 if nothing differs.
+static int stk500_eeprom_dirty_span(const stk500_image_t *image, const unsigned char *chip, unsigned int *first, unsigned int *last) {
+    while (*first < *last && image->data[*first] == chip[*first]) (*first)++;
+    if (*first == *last) return 0;
+    while (image->data[*last - 1] == chip[*last - 1]) (*last)--;
+    *first &= ~1u;
+    return 1;
+}
+
+// Brings EEPROM [0, top) in line with the image; bytes past image->top count as 0xFF
+static int stk500_program_eeprom(int fd, const stk500_image_t *image, unsigned int top, unsigned char *chip, int verify) {
+    int window = stk500.window < STK500_EEPROM_WINDOW ? stk500.window : STK500_EEPROM_WINDOW;
+    if (!stk500_read_eeprom(fd, chip, top, stk500.window)) {
+        return 0;
+    }
+
+    // One frame per EEPROM page at most, so each frame is answered within the read timeout
+    unsigned int span = stk500_part->eeprom_page ? stk500_part->eeprom_page : STK500_EEPROM_MAX_SPAN;
+    if (span > STK500_EEPROM_MAX_SPAN) span = STK500_EEPROM_MAX_SPAN;
+    int total = 0;
+    for (unsigned int page = 0; page < top; page += span) {
+        unsigned int first = page, last = page + span < top ? page + span : top;
+        if (stk500_eeprom_dirty_span(image, chip, &first, &last)) total += last - first;
+    }
+    if (total == 0) {
+        stk500_log("EEPROM unchanged (%u bytes)\n", top);
+        return 1;
+    }
+
+    stk500_pipeline_t pipe = { .fd = fd, .window = window, .head = 0, .count = 0 };
+    unsigned int written = 0;
+    stk500_stage_begin("EEPROM", "bytes", total);
+    for (unsigned int page = 0; page < top; page += span) {
+        unsigned int first = page, last = page + span < top ? page + span : top;
+        if (!stk500_eeprom_dirty_span(image, chip, &first, &last)) {
+            continue;
+        }
+        stk500_page_t current = { .address = first / 2, .length = last - first, .memtype = 'E' };
+        memcpy(current.data, &image->data[first], current.length);
+        if (!stk500_pipeline_program_page(&pipe, &current, current.length)) {
+            stk500_log("Failed to write EEPROM at 0x%04X\n", first);
+            stk500_stage_end(0);
+            return 0;
+        }
+        written += current.length;
+    }
+    if (!stk500_pipeline_flush(&pipe)) {
+        stk500_log("Failed to complete EEPROM programming\n");
+        stk500_stage_end(0);
+        return 0;
+    }
+    stk500_stage_end(1);
+
+    if (verify) {
+        if (!stk500_read_eeprom(fd, chip, top, stk500.window)) {
+            return 0;
+        }
+        for (unsigned int addr = 0; addr < top; addr++) {
+            if (chip[addr] != image->data[addr]) {
+                stk500_log("EEPROM verification failed at address 0x%04X\n", addr);
+                return 0;
+            }
+        }
+    }
+    stk500_log("EEPROM: wrote %u of %u bytes%s\n", written, top, verify ? ", verified" : "");
+    return 1;
+}
+
+// Programs EEPROM from a HEX whose addresses start at 0, e.g. from
+// avr-objcopy -j .eeprom --change-section-lma .eeprom=0. Only bytes that differ
+// from a readback are sent. Call it after flash: a chip erase clears EEPROM
+// unless the EESAVE fuse is programmed.
+static int stk500_eeprom_span(const stk500_image_t *image, unsigned int top, int verify) {
+    if (stk500.fd < 0 || stk500_part == NULL) {
+        return 0;
+    }
+    unsigned int size = stk500_part->eeprom_size;
+    if (image->top > size) {
+        stk500_log("Image does not fit the %u byte EEPROM of %s\n", size, stk500_part->desc);
+        return 0;
+    }
+    unsigned char *chip = malloc(size + 1);
+    int ok = chip != NULL && (top == 0 || stk500_program_eeprom(stk500.fd, image, top, chip, verify));
+    free(chip);
+    return ok;
+}
+
+static int stk500_write_eeprom(const char *filename, int verify) {
+    stk500_image_t *image = malloc(sizeof(stk500_image_t));
+    int ok = image && stk500.fd >= 0 && stk500_load_hex_file(filename, image) && stk500_eeprom_span(image, image->top, verify);
+    free(image);
+    return ok;
+}
+
+// Restores the whole EEPROM from an image, e.g. a backup. A HEX backup leaves
+// out rows that are all 0xFF, so its image ends at the last programmed byte;
+// everything past that is written back as erased rather than left as it is.
+static int stk500_eeprom_image(const stk500_image_t *image, int verify) {
+    return stk500_part != NULL && stk500_eeprom_span(image, stk500_part->eeprom_size, verify);
+}
+
+// Reads all of flash ('F') or EEPROM ('E') into image, e.g. for a backup. Reads are
+// pipelined STK500_READ_CHUNK requests, so the link stays busy close to its line rate.
+static int stk500_read_memory(char memtype, stk500_image_t *image) {
+    if (stk500.fd < 0 || stk500_part == NULL) {
+        return 0;
+    }
+    memset(image->data, 0xFF, sizeof(image->data));
+    image->top = 0;
+    if (memtype == 'F') {
+        return stk500_read_flash(stk500.fd, image, stk500.window);
+    }
+    if (memtype == 'E' && stk500_read_eeprom(stk500.fd, image->data, stk500_part->eeprom_size, stk500.window)) {
+        image->top = stk500_part->eeprom_size;
+        return 1;
+    }
+    return 0;
+}
+
+// Leaves programming mode and releases the port. A successful session is
+// remembered so the next connect can skip discovery. Returns success, so
+// error paths can end with `return stk500_close(0);`
+static int stk500_close(int success) {
+    if (stk500.fd < 0) {
+        return 0;
+    }
+    if (stk500_in_progmode && !stk500_leave_program_mode(stk500.fd)) {
+        success = 0;
+    }
+    stk500_in_progmode = 0;
+    if (success) {
+        stk500_session.valid = 1;
+        if (stk500_remember) stk500_save_session(&stk500_session);
+        if (stk500_isp_clock != STK500_SCK_UNKNOWN) {
+            stk500_save_isp_clock(stk500_session.signature, stk500_isp_clock);
+        }
+    }
+    close(stk500.fd);
+    stk500.fd = -1;
+    stk500.part = NULL;
+    stk500_telemetry.end_us = serial.now();
+    return success;
+}
+
+static const char *stk500_port(void) {
+    return stk500_session.port;
+}
+
+static long long stk500_session_us(void) {
+    long long end = stk500_telemetry.end_us ? stk500_telemetry.end_us : serial.now();
+    return end - stk500_telemetry.start_us;
+}
+
+// Time the bytes of the session would take on the wire at the nominal baud rate
+static long long stk500_line_us(void) {
+    unsigned long bytes = stk500_telemetry.bytes_out > stk500_telemetry.bytes_in ? stk500_telemetry.bytes_out : stk500_telemetry.bytes_in;
+    return (long long)bytes * STK500_BITS_PER_BYTE * 1000000 / STK500_BAUD;
+}
+
+// Prints the round-trip histogram of each command kind that was used, the byte
+// rates, and how the session's time split between writing, waiting and the rest
+static void stk500_report(void) {
+    const stk500_telemetry_t *t = &stk500_telemetry;
+    long long session = stk500_session_us();
+    if (session <= 0) return;
+
+    char line[256];
+    int n = snprintf(line, sizeof(line), "%-13s %6s %4s %8s %8s %8s ", "RTT (ms)", "count", "fail", "min", "avg", "max");
+    for (int b = 0; b < STK500_RTT_BUCKETS; b++) {
+        if (b < STK500_RTT_BUCKETS - 1) {
+            n += snprintf(line + n, sizeof(line) - n, " <%-4g", (STK500_RTT_FIRST_US << b) / 1000.0);
+        } else {
+            n += snprintf(line + n, sizeof(line) - n, " more");
+        }
+    }
+    stk500_log("%s\n", line);
+    for (int kind = 0; kind < STK500_CMD_KINDS; kind++) {
+        const stk500_rtt_t *rtt = &t->commands[kind];
+        if (rtt->count == 0 && rtt->failed == 0) continue;
+        n = snprintf(line, sizeof(line), "%-13s %6lu %4lu %8.2f %8.2f %8.2f ", stk500_command_names[kind], rtt->count, rtt->failed,
+                     rtt->min_us / 1000.0, rtt->count ? rtt->total_us / 1000.0 / rtt->count : 0.0, rtt->max_us / 1000.0);
+        for (int b = 0; b < STK500_RTT_BUCKETS; b++) {
+            n += snprintf(line + n, sizeof(line) - n, " %5lu", rtt->histogram[b]);
+        }
+        stk500_log("%s\n", line);
+    }
+
+    double seconds = session / 1e6;
+    stk500_log("%lu bytes out (%.0f B/s), %lu bytes in (%.0f B/s) in %.2f s; %d baud needs %.2f s\n",
+               t->bytes_out, t->bytes_out / seconds, t->bytes_in, t->bytes_in / seconds, seconds, STK500_BAUD, stk500_line_us() / 1e6);
+    long long other = session - t->wait_us - t->write_us;
+    stk500_log("Time: %.0f%% waiting for responses, %.0f%% writing, %.0f%% elsewhere (delays, host)\n",
+               100.0 * t->wait_us / session, 100.0 * t->write_us / session, 100.0 * (other > 0 ? other : 0) / session);
+}
+
+// Writes the same numbers as JSON, with the bucket bounds, for plotting across boards
+static int stk500_dump(const char *path) {
+    const stk500_telemetry_t *t = &stk500_telemetry;
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return 0;
+
+    fprintf(fp, "{\n  \"port\": \"%s\",\n  \"serial\": \"%s\",\n", stk500_session.port, stk500_session.serial);
+    fprintf(fp, "  \"signature\": \"%02x%02x%02x\",\n  \"isp_clock\": %d,\n", stk500_session.signature[0],
+            stk500_session.signature[1], stk500_session.signature[2], stk500_isp_clock);
+    fprintf(fp, "  \"baud\": %d,\n  \"session_us\": %lld,\n  \"line_us\": %lld,\n  \"write_us\": %lld,\n  \"wait_us\": %lld,\n",
+            STK500_BAUD, stk500_session_us(), stk500_line_us(), t->write_us, t->wait_us);
+    fprintf(fp, "  \"bytes_out\": %lu,\n  \"bytes_in\": %lu,\n  \"bucket_upper_us\": [", t->bytes_out, t->bytes_in);
+    for (int b = 0; b < STK500_RTT_BUCKETS - 1; b++) {
+        fprintf(fp, "%s%d", b ? ", " : "", STK500_RTT_FIRST_US << b);
+    }
+    fprintf(fp, "],\n  \"commands\": {");
+    for (int kind = 0; kind < STK500_CMD_KINDS; kind++) {
+        const stk500_rtt_t *rtt = &t->commands[kind];
+        fprintf(fp, "%s\n    \"%s\": {\"count\": %lu, \"failed\": %lu, \"total_us\": %lld, \"min_us\": %lld, \"max_us\": %lld, \"histogram\": [",
+                kind ? "," : "", stk500_command_names[kind], rtt->count, rtt->failed, rtt->total_us, rtt->min_us, rtt->max_us);
+        for (int b = 0; b < STK500_RTT_BUCKETS; b++) {
+            fprintf(fp, "%s%lu", b ? ", " : "", rtt->histogram[b]);
+        }
+        fprintf(fp, "]}");
+    }
+    fprintf(fp, "\n  }\n}\n");
+    return fclose(fp) == 0;
+}
+
+#endif // STK500_H
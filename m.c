@@ -14,10 +14,27 @@
 
 #include "lib/terminal.h"
 #include "lib/resource.h"
+#include "lib/build.h"
+#include "lib/elf.h"
+#include "lib/stk500.h"
 
 #define VERSION "0.0.1"
 #define MAX_LINES 1000
 #define MAX_LINE_LENGTH 1000
+#define TARGET_MCU "attiny85"
+#define TARGET_F_CPU 8000000UL
+#define TARGET_CFLAGS "-g -Os"
+#define SKETCH_FLAGS_FILE "blink.flags"
+#define PROJECT_MANIFEST "m.project"
+#define EXPLORE_DIR BUILD_CACHE_DIR "/explore"
+#define TARGET_FLASH_SIZE 8192
+#define TARGET_RAM_SIZE 512
+#define BUDGET_BAR_WIDTH 20
+#define TARGET_PART "t85"
+#define TARGET_LFUSE 0xE2   // 8 MHz internal oscillator, no CKDIV8
+#define TARGET_HFUSE 0xDF
+#define TARGET_EFUSE 0xFF   // factory default: self-programming off
+#define PROGRESS_WIDTH 48
 
 const char *ascii_image[] = {
     "      ┌───┐         ┌───┐      ",
@@ -43,6 +60,13 @@ typedef enum State {
 
 State state = DEFAULT;
 
+// Compiler flags for this sketch, picked with the flag explorer and kept in blink.flags
+char build_flags[256] = TARGET_CFLAGS;
+
+// Section sizes of the previous successful build, for the size delta
+elf_size_t last_size;
+bool have_last_size = false;
+
 // Text editor data
 char **text_buffer;
 int num_lines = 1; // Start with one empty line
@@ -209,7 +233,7 @@ void refresh() {
 }
 
 void write_headers_to_file(FILE *fp) {
-    fprintf(fp, "#define F_CPU 8000000UL\n");
+    fprintf(fp, "#define F_CPU %luUL\n", TARGET_F_CPU);
     fprintf(fp, "#include \"blink.h\"\n\n");
 }
 
@@ -244,12 +268,33 @@ void reapply_quarantine() {
     terminal.input();
 }
 
-void compile_and_program() {
-    // Write text buffer to file
-    FILE *fp = fopen("blink.c", "w");
+void draw_budget(const char *label, unsigned int used, unsigned int total, long delta, bool show_delta, int x, int y) {
+    int filled = total ? (int)((unsigned long)used * BUDGET_BAR_WIDTH / total) : 0;
+    if (filled > BUDGET_BAR_WIDTH) filled = BUDGET_BAR_WIDTH;
+
+    char text[64];
+    snprintf(text, sizeof(text), "%-5s", label);
+    terminal.write(text, x, y);
+    for (int i = 0; i < BUDGET_BAR_WIDTH; i++) {
+        terminal.write(i < filled ? square_fill : "░", x + 6 + i, y);
+    }
+    if (show_delta) {
+        snprintf(text, sizeof(text), " %u/%u %+ld", used, total, delta);
+    } else {
+        snprintf(text, sizeof(text), " %u/%u", used, total);
+    }
+    terminal.write(text, x + 6 + BUDGET_BAR_WIDTH, y);
+}
+
+// Writes the buffer to blink.c, leaving the file (and its mtime) alone when the
+// content is unchanged so incremental project builds can skip it
+bool write_sketch() {
+    char *content = NULL;
+    size_t length = 0;
+    FILE *fp = open_memstream(&content, &length);
     if (fp == NULL) {
         perror("Error opening file");
-        return;
+        return false;
     }
     write_headers_to_file(fp);
     for (int i = 0; i < num_lines; i++) {
@@ -257,6 +302,271 @@ void compile_and_program() {
     }
     fclose(fp);
 
+    bool same = false;
+    fp = fopen("blink.c", "rb");
+    if (fp != NULL) {
+        char *existing = malloc(length + 1);
+        same = existing != NULL && fread(existing, 1, length + 1, fp) == length && memcmp(existing, content, length) == 0;
+        free(existing);
+        fclose(fp);
+    }
+
+    if (!same) {
+        fp = fopen("blink.c", "w");
+        if (fp == NULL) {
+            perror("Error opening file");
+            free(content);
+            return false;
+        }
+        fwrite(content, 1, length, fp);
+        fclose(fp);
+    }
+    free(content);
+    return true;
+}
+
+void load_build_flags() {
+    FILE *fp = fopen(SKETCH_FLAGS_FILE, "r");
+    if (fp == NULL) {
+        return;
+    }
+    if (fgets(build_flags, sizeof(build_flags), fp) != NULL) {
+        build_flags[strcspn(build_flags, "\r\n")] = '\0';
+    }
+    if (build_flags[0] == '\0') {
+        snprintf(build_flags, sizeof(build_flags), "%s", TARGET_CFLAGS);
+    }
+    fclose(fp);
+}
+
+void save_build_flags() {
+    FILE *fp = fopen(SKETCH_FLAGS_FILE, "w");
+    if (fp == NULL) {
+        return;
+    }
+    fprintf(fp, "%s\n", build_flags);
+    fclose(fp);
+}
+
+const char *toolchain_folder(const char **exe_ext) {
+    *exe_ext = IsWindows() ? ".exe" : "";
+    if (IsLinux()) return "./resource/linux/";
+    if (IsWindows()) return "./resource/windows/";
+    if (IsXnu()) return "./resource/mac/";
+    return NULL;
+}
+
+typedef struct {
+    char flags[160];
+    int code;
+    double ms;
+    elf_size_t size;
+} Variant;
+
+const char *explore_levels[] = {"-Os", "-O2", "-O3"};
+const char *explore_extras[] = {
+    "",
+    "-flto",
+    "-mrelax",
+    "-ffunction-sections -fdata-sections -Wl,--gc-sections",
+    "-mcall-prologues",
+    "-flto -mrelax -ffunction-sections -fdata-sections -Wl,--gc-sections -mcall-prologues"
+};
+
+#define EXPLORE_LEVELS (sizeof(explore_levels) / sizeof(explore_levels[0]))
+#define EXPLORE_EXTRAS (sizeof(explore_extras) / sizeof(explore_extras[0]))
+#define EXPLORE_VARIANTS (EXPLORE_LEVELS * EXPLORE_EXTRAS)
+
+int compare_variants(const void *a, const void *b) {
+    const Variant *va = a, *vb = b;
+    if ((va->code != 0) != (vb->code != 0)) return va->code != 0 ? 1 : -1;
+    if (va->size.flash != vb->size.flash) return va->size.flash < vb->size.flash ? -1 : 1;
+    if (va->size.ram != vb->size.ram) return va->size.ram < vb->size.ram ? -1 : 1;
+    return va->ms < vb->ms ? -1 : va->ms > vb->ms;
+}
+
+// Compiles the buffer under every flag combination at once and lets the user
+// pick the smallest (or any) variant as this sketch's default flags
+void explore_flags() {
+    const char *exe_ext;
+    const char *os_folder = toolchain_folder(&exe_ext);
+    if (os_folder == NULL || !write_sketch() || build.mkdirs(EXPLORE_DIR) != 0) {
+        return;
+    }
+
+    int window_width = 72;
+    int window_height = 6;
+    int start_x = (terminal.cols - window_width) / 2;
+    int start_y = (terminal.rows - window_height) / 2;
+    refresh();
+    terminal.box(start_x, start_y, window_width, window_height);
+
+    // Variants are sized from blink.c alone, which is not what a project build links
+    if (access(PROJECT_MANIFEST, F_OK) == 0) {
+        terminal.write("The explorer sizes blink.c alone; " PROJECT_MANIFEST " builds differ.", start_x + 2, start_y + 2);
+        terminal.write("Press any key to continue...", start_x + 2, start_y + 3);
+        terminal.draw();
+        terminal.input();
+        return;
+    }
+
+    char status[64];
+    snprintf(status, sizeof(status), "Building %d variants on %d cores...", (int)EXPLORE_VARIANTS, build.cores());
+    terminal.write(status, start_x + 2, start_y + 2);
+    terminal.draw();
+
+    Variant variants[EXPLORE_VARIANTS];
+    char commands[EXPLORE_VARIANTS][BUILD_CMD_LENGTH];
+    int codes[EXPLORE_VARIANTS];
+    double ms[EXPLORE_VARIANTS];
+    for (size_t i = 0; i < EXPLORE_VARIANTS; i++) {
+        Variant *v = &variants[i];
+        snprintf(v->flags, sizeof(v->flags), "-g %s%s%s", explore_levels[i / EXPLORE_EXTRAS],
+                 explore_extras[i % EXPLORE_EXTRAS][0] ? " " : "", explore_extras[i % EXPLORE_EXTRAS]);
+        if (snprintf(commands[i], sizeof(commands[i]), "\"%savrgcc/bin/avr-gcc%s\" %s -mmcu=%s -DF_CPU=%luUL -o %s/%d.elf blink.c > %s 2>&1",
+                     os_folder, exe_ext, v->flags, TARGET_MCU, TARGET_F_CPU, EXPLORE_DIR, (int)i,
+                     IsWindows() ? "NUL" : "/dev/null") >= (int)sizeof(commands[i])) {
+            snprintf(commands[i], sizeof(commands[i]), "exit 1");  // never run a truncated command line
+        }
+    }
+
+    build.parallel(commands, EXPLORE_VARIANTS, codes, ms);
+
+    for (size_t i = 0; i < EXPLORE_VARIANTS; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%d.elf", EXPLORE_DIR, (int)i);
+        variants[i].code = codes[i];
+        variants[i].ms = ms[i];
+        if (codes[i] != 0 || elf.size(path, &variants[i].size) != 0) {
+            variants[i].code = codes[i] ? codes[i] : -1;
+        }
+        remove(path);
+    }
+    qsort(variants, EXPLORE_VARIANTS, sizeof(Variant), compare_variants);
+
+    // Show as many rows as fit, smallest flash first
+    const char *keys = "0123456789abcdefghijklmnopqrstuvwxyz";
+    int rows = EXPLORE_VARIANTS;
+    if (rows > terminal.rows - 8) rows = terminal.rows - 8;
+    if (rows > (int)strlen(keys)) rows = strlen(keys);
+    if (rows < 1) rows = 1;
+    window_height = rows + 6;
+    start_y = (terminal.rows - window_height) / 2;
+
+    refresh();
+    terminal.box(start_x, start_y, window_width, window_height);
+    const char *title = "Optimization Flag Explorer";
+    terminal.write(title, start_x + (window_width - strlen(title)) / 2, start_y);
+    terminal.write("   FLASH   RAM     ms  FLAGS", start_x + 2, start_y + 1);
+    // Rows sit between a column of padding on each side of the frame; the flags get what the fixed columns leave
+    int flags_width = window_width - 4 - (int)strlen("k 123456 12345 123456  ");
+    for (int i = 0; i < rows; i++) {
+        Variant *v = &variants[i];
+        char line[128];
+        if (v->code == 0) {
+            snprintf(line, sizeof(line), "%c %6u %5u %6.0f  %.*s", keys[i], v->size.flash, v->size.ram, v->ms, flags_width, v->flags);
+        } else {
+            snprintf(line, sizeof(line), "%c %6s %5s %6.0f  %.*s", keys[i], "failed", "-", v->ms, flags_width, v->flags);
+        }
+        terminal.write(line, start_x + 2, start_y + 2 + i);
+    }
+    snprintf(status, sizeof(status), "Current: %.50s", build_flags);
+    terminal.write(status, start_x + 2, start_y + window_height - 3);
+    terminal.write("Press a key to select a variant, Esc to keep current...", start_x + 2, start_y + window_height - 2);
+    terminal.draw();
+
+    char c = terminal.input();
+    const char *picked = c ? strchr(keys, c) : NULL;
+    if (picked != NULL && picked - keys < rows && variants[picked - keys].code == 0) {
+        snprintf(build_flags, sizeof(build_flags), "%s", variants[picked - keys].flags);
+        save_build_flags();
+    }
+}
+
+// Geometry of the programming status box, kept for the stk500 event handlers
+int progress_x;
+int progress_y;
+
+void draw_program_message(const char *text) {
+    char line[PROGRESS_WIDTH - 3];
+    snprintf(line, sizeof(line), "%-*s", (int)sizeof(line) - 1, text);
+    terminal.write(line, progress_x + 2, progress_y + 2);
+    terminal.draw();
+}
+
+// Bar and count on one row, rate and estimate below it. The ETA is marked with
+// a * when it draws on earlier runs through this programmer.
+void draw_program_progress(const stk500_progress_t *progress) {
+    int filled = progress->total ? progress->done * BUDGET_BAR_WIDTH / progress->total : 0;
+    if (filled > BUDGET_BAR_WIDTH) filled = BUDGET_BAR_WIDTH;
+
+    char text[48];
+    snprintf(text, sizeof(text), "%-6s", progress->stage);
+    terminal.write(text, progress_x + 2, progress_y + 3);
+    for (int i = 0; i < BUDGET_BAR_WIDTH; i++) {
+        terminal.write(i < filled ? square_fill : "░", progress_x + 9 + i, progress_y + 3);
+    }
+    snprintf(text, sizeof(text), " %d/%d %s   ", progress->done, progress->total, progress->unit);
+    terminal.write(text, progress_x + 9 + BUDGET_BAR_WIDTH, progress_y + 3);
+
+    char eta[16] = "--:--";
+    if (progress->eta_s >= 0) {
+        int seconds = (int)(progress->eta_s + 0.5);
+        snprintf(eta, sizeof(eta), "%d:%02d%s", seconds / 60, seconds % 60, progress->calibrated ? "*" : "");
+    }
+    char line[PROGRESS_WIDTH - 3];
+    snprintf(text, sizeof(text), "%5.0f B/s  %5.1fs  ETA %s", progress->bytes_per_s, progress->elapsed_s, eta);
+    snprintf(line, sizeof(line), "%-*.*s", (int)sizeof(line) - 1, (int)sizeof(line) - 1, text);
+    terminal.write(line, progress_x + 2, progress_y + 4);
+    terminal.draw();
+}
+
+// Connects to the ArduinoISP once and sets the fuses, then writes and verifies
+// flash and EEPROM in that same session, recording each step as a build stage
+int program_target() {
+    progress_x = (terminal.cols - PROGRESS_WIDTH) / 2;
+    progress_y = (terminal.rows - 6) / 2;
+    refresh();
+    terminal.box(progress_x, progress_y, PROGRESS_WIDTH, 6);
+    terminal.write("Programming", progress_x + (PROGRESS_WIDTH - 11) / 2, progress_y);
+    terminal.draw();
+    stk500.listen(STK500_MESSAGE, draw_program_message);
+    stk500.listen(STK500_PROGRESS, draw_program_progress);
+
+    double start = build.now();
+    int ok = stk500.connect(TARGET_PART, 0, 0, 0, 0);
+    build.record("CONNECT", !ok, build.now() - start);
+    if (ok) {
+        start = build.now();
+        // Each fuse is read first and only written when it differs
+        ok = stk500.write_fuse("lfuse", TARGET_LFUSE) && stk500.write_fuse("hfuse", TARGET_HFUSE) &&
+             stk500.write_fuse("efuse", TARGET_EFUSE);
+        build.record("FUSES", !ok, build.now() - start);
+    }
+    if (ok) {
+        start = build.now();
+        ok = stk500.flash("blink.hex", STK500_FULL, 1);
+        build.record("FLASH", !ok, build.now() - start);
+    }
+    if (ok) {
+        // After flash, whose chip erase clears EEPROM; only differing bytes are written
+        start = build.now();
+        ok = stk500.eeprom("blink.eep", 1);
+        build.record("EEPROM", !ok, build.now() - start);
+    }
+    ok = stk500.close(ok);
+
+    stk500.listen(STK500_MESSAGE, NULL);
+    stk500.listen(STK500_PROGRESS, NULL);
+    return ok ? 0 : 1;
+}
+
+void compile_and_program() {
+    // Write text buffer to file
+    if (!write_sketch()) {
+        return;
+    }
+
     const char* os_folder = NULL;
     const char* exe_ext = "";
     bool need_chmod = false;
@@ -331,27 +641,59 @@ void compile_and_program() {
     }
 
     */
-    // Commands to run
-    char commands[4][256];
-    snprintf(commands[0], sizeof(commands[0]), "\"%savrgcc/bin/avr-gcc%s\" -g -Os -mmcu=attiny85 -DF_CPU=8000000UL -o blink.elf blink.c 2>&1", os_folder, exe_ext);
-    snprintf(commands[1], sizeof(commands[1]), "\"%savrgcc/bin/avr-objcopy%s\" -O ihex blink.elf blink.hex 2>&1", os_folder, exe_ext);
-    snprintf(commands[2], sizeof(commands[2]), "\"%savrdude/avrdude%s\" -P /dev/cu.usbmodem1101 -c stk500v1 -p t85 -b 19200 -U lfuse:w:0xE2:m -U hfuse:w:0xDF:m 2>&1", os_folder, exe_ext);
-    snprintf(commands[3], sizeof(commands[3]), "\"%savrdude/avrdude%s\" -P /dev/cu.usbmodem1101 -c stk500v1 -p t85 -b 19200 -U flash:w:blink.hex:i 2>&1", os_folder, exe_ext);
+    // Precompile the blink.h prologue once per MCU/F_CPU; an empty flag string falls back to a plain compile
+    build.begin();
+    char compiler[PATH_MAX];
+    char pch_flags[PATH_MAX + 64];
+    snprintf(compiler, sizeof(compiler), "%savrgcc/bin/avr-gcc%s", os_folder, exe_ext);
+    double pch_start = build.now();
+    int pch_code = build.precompile(compiler, TARGET_MCU, TARGET_F_CPU, build_flags, pch_flags, sizeof(pch_flags));
+    build.record("PCH", pch_code, build.now() - pch_start);
+
+    // Commands to run; programming happens in-process afterwards
+    const char *stage_names[3] = {"AVRGCC", "OBJCOPY", "EEPCOPY"};
+    char commands[3][BUILD_CMD_LENGTH];
+    int lengths[3];
+    lengths[0] = snprintf(commands[0], sizeof(commands[0]), "\"%s\" %s %s -mmcu=%s -DF_CPU=%luUL -o blink.elf blink.c 2>&1", compiler, build_flags, pch_flags, TARGET_MCU, TARGET_F_CPU);
+    lengths[1] = snprintf(commands[1], sizeof(commands[1]), "\"%savrgcc/bin/avr-objcopy%s\" -R .eeprom -O ihex blink.elf blink.hex 2>&1", os_folder, exe_ext);
+    // EEMEM data goes to its own HEX based at 0; without any it holds just the end record
+    lengths[2] = snprintf(commands[2], sizeof(commands[2]), "\"%savrgcc/bin/avr-objcopy%s\" -j .eeprom --set-section-flags=.eeprom=alloc,load "
+                          "--change-section-lma .eeprom=0 --no-change-warnings -O ihex blink.elf blink.eep 2>&1", os_folder, exe_ext);
 
     // Execute commands and redirect output to null using shell redirection
-    char redirected_cmd[512];
-    int return_codes[4];
-    for (int i = 0; i < 4; i++) {
-        snprintf(redirected_cmd, sizeof(redirected_cmd), "%s > %s 2>&1", commands[i], IsWindows() ? "NUL" : "/dev/null");
-        return_codes[i] = system(redirected_cmd);
-        if (return_codes[i] != 0) {
+    char redirected_cmd[BUILD_CMD_LENGTH + 32];
+    remove("blink.elf");  // A failed compile must not report the previous image's size
+    int code = 0;
+    for (int i = 0; i < 3; i++) {
+        if (i == 0 && access(PROJECT_MANIFEST, F_OK) == 0) {
+            // Multi-file project: incremental parallel compile of the manifest, then one link
+            code = build.project(PROJECT_MANIFEST, compiler, TARGET_MCU, TARGET_F_CPU, build_flags, pch_flags, "blink.elf");
+        } else if (lengths[i] >= (int)sizeof(commands[i]) ||
+                   snprintf(redirected_cmd, sizeof(redirected_cmd), "%s > %s 2>&1", commands[i],
+                            IsWindows() ? "NUL" : "/dev/null") >= (int)sizeof(redirected_cmd)) {
+            // A truncated command line would run something other than intended
+            code = -1;
+            build.record(stage_names[i], code, 0);
+        } else {
+            code = build.run(stage_names[i], redirected_cmd);
+        }
+        if (code != 0) {
             break; // Stop executing further commands if one fails
         }
     }
+    if (code == 0) {
+        program_target();
+    }
+    build.end();
+
+    // Read the flash/RAM footprint straight from the ELF once the compile succeeded
+    elf_size_t size;
+    bool have_size = elf.size("blink.elf", &size) == 0;
 
     // Display output in centered window
-    int window_width = 40;
-    int window_height = 10;
+    build_run_t *run = build.last(0);
+    int window_width = 48;
+    int window_height = run->count + (have_size ? 11 : 8);
     int start_x = (terminal.cols - window_width) / 2;
     int start_y = (terminal.rows - window_height) / 2;
 
@@ -363,28 +705,30 @@ void compile_and_program() {
     const char *title = "Compilation and Programming Results";
     terminal.write(title, start_x + (window_width - strlen(title)) / 2, start_y);
 
-    // write return codes
-    for (int i = 0; i < 4; i++) {
-        char result[40];
-        switch (i) {
-            case 0:
-                snprintf(result, sizeof(result), "AVRGCC:  %d", return_codes[i]);
-                break;
-            case 1:
-                snprintf(result, sizeof(result), "OBJCOPY: %d", return_codes[i]);
-                break;
-            case 2:
-                snprintf(result, sizeof(result), "FUSES:   %d", return_codes[i]);
-                break;
-            case 3:
-                snprintf(result, sizeof(result), "FLASH:   %d", return_codes[i]);
-                break;
-        }
-        
-        
+    // write return codes and timings, marking the stage that dominated this run
+    int dominant = build.dominant(run);
+    for (int i = 0; i < run->count; i++) {
+        build_stage_t *stage = &run->stages[i];
+        double average = build.average(stage->name);
+        char result[64];
+        snprintf(result, sizeof(result), "%-8s %4d %8.0f ms %3.0f%% avg %6.0f %s",
+                 stage->name, stage->code, stage->ms,
+                 run->total_ms > 0 ? 100.0 * stage->ms / run->total_ms : 0.0,
+                 average, i == dominant ? "<" : " ");
         terminal.write(result, start_x + 2, start_y + 2 + i);
     }
 
+    char total[64];
+    snprintf(total, sizeof(total), "TOTAL    %13.0f ms (%d runs)", run->total_ms, build.runs);
+    terminal.write(total, start_x + 2, start_y + 3 + run->count);
+
+    if (have_size) {
+        draw_budget("FLASH", size.flash, TARGET_FLASH_SIZE, (long)size.flash - (long)last_size.flash, have_last_size, start_x + 2, start_y + 5 + run->count);
+        draw_budget("RAM", size.ram, TARGET_RAM_SIZE, (long)size.ram - (long)last_size.ram, have_last_size, start_x + 2, start_y + 6 + run->count);
+        last_size = size;
+        have_last_size = true;
+    }
+
     // Wait for user input to close the window
     terminal.write("Press any key to continue...", start_x + 2, start_y + window_height - 2);
     terminal.draw();
@@ -414,6 +758,10 @@ void processKey(char c) {
             compile_and_program();
             refresh();
             break;
+        case '#':
+            explore_flags();
+            refresh();
+            break;
         case '\r':
             insert_newline();
             draw_text();
@@ -472,6 +820,7 @@ int main(int argc, char *argv[]) {
     terminal.listen(RESIZE, handle_resize);
     
     init_text_buffer();
+    load_build_flags();
     
     state = EXTRACTING;
     refresh();
@@ -1,103 +1,92 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <termios.h>
 #include <unistd.h>
 #include <dirent.h>
-#include <sys/select.h>
+
+#include "lib/serial.h"
 
 #define MAX_PATH 1024
 #define BUFFER_SIZE 256
 #define SYNC_ATTEMPTS 3
+#define MAX_PORTS 64
+#define INIT_DELAY_US 100000
+#define SYNC_TIMEOUT_US 1000000
+#define ARDUINOISP_BAUD 19200
 
-int set_interface_attribs(int fd, int speed) {
-    struct termios tty;
-    memset(&tty, 0, sizeof tty);
-    if (tcgetattr(fd, &tty) != 0) return -1;
-    cfsetospeed(&tty, speed);
-    cfsetispeed(&tty, speed);
-    tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8;
-    tty.c_iflag &= ~IGNBRK;
-    tty.c_lflag = 0;
-    tty.c_oflag = 0;
-    tty.c_cc[VMIN]  = 0;
-    tty.c_cc[VTIME] = 5;
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
-    tty.c_cflag |= (CLOCAL | CREAD);
-    tty.c_cflag &= ~(PARENB | PARODD);
-    tty.c_cflag &= ~CSTOPB;
-    tty.c_cflag &= ~CRTSCTS;
-    if (tcsetattr(fd, TCSANOW, &tty) != 0) return -1;
-    return 0;
-}
-
-int check_arduinoisp(const char *port) {
-    int fd = open(port, O_RDWR | O_NOCTTY | O_SYNC);
-    if (fd < 0) return 0;
+// Opens every port up front, waits a single init delay for all of them, then
+// sends GET_SYNC to each and waits on them together; the first to reply wins
+int find_arduinoisp(char paths[][MAX_PATH], int count) {
+    int fds[MAX_PORTS];
+    unsigned char last[MAX_PORTS][2];
 
-    if (set_interface_attribs(fd, B19200) != 0) {
-        close(fd);
-        return 0;
+    for (int i = 0; i < count; i++) {
+        fds[i] = serial.open(paths[i], ARDUINOISP_BAUD);
     }
 
-    // Wait for device to initialize
-    usleep(100000);  // 100ms delay
+    // Wait for devices to initialize
+    usleep(INIT_DELAY_US);
 
     unsigned char cmd[] = {0x30, 0x20};
-    unsigned char resp[2];
-    fd_set readfds;
-    struct timeval timeout;
-
-    for (int attempt = 0; attempt < SYNC_ATTEMPTS; attempt++) {
-        if (write(fd, cmd, sizeof(cmd)) != sizeof(cmd)) {
-            close(fd);
-            return 0;
+    int winner = -1;
+    for (int attempt = 0; attempt < SYNC_ATTEMPTS && winner < 0; attempt++) {
+        for (int i = 0; i < count; i++) {
+            if (fds[i] < 0) continue;
+            last[i][0] = last[i][1] = 0;
+            if (!serial.write(fds[i], cmd, sizeof(cmd))) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
         }
 
-        FD_ZERO(&readfds);
-        FD_SET(fd, &readfds);
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-
-        if (select(fd + 1, &readfds, NULL, NULL, &timeout) > 0) {
-            if (read(fd, resp, sizeof(resp)) == 2 && resp[0] == 0x14 && resp[1] == 0x10) {
-                close(fd);
-                return 1;
+        long long deadline = serial.now() + SYNC_TIMEOUT_US;
+        while (winner < 0 && serial.wait_any(fds, count, deadline) >= 0) {
+            for (int i = 0; i < count && winner < 0; i++) {
+                if (fds[i] < 0) continue;
+                unsigned char buf[64];
+                int n = serial.read(fds[i], buf, sizeof(buf), 0);
+                for (int j = 0; j < n; j++) {
+                    last[i][0] = last[i][1];
+                    last[i][1] = buf[j];
+                    if (last[i][0] == 0x14 && last[i][1] == 0x10) {
+                        winner = i;
+                        break;
+                    }
+                }
             }
         }
-
-        // Wait a bit before next attempt
-        usleep(50000);  // 50ms delay
     }
 
-    close(fd);
-    return 0;
+    for (int i = 0; i < count; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    return winner;
 }
 
 int main() {
     DIR *d;
     struct dirent *dir;
-    char path[MAX_PATH];
+    char paths[MAX_PORTS][MAX_PATH];
+    int count = 0;
 
     d = opendir("/dev");
     if (d) {
-        while ((dir = readdir(d)) != NULL) {
+        while ((dir = readdir(d)) != NULL && count < MAX_PORTS) {
             if (strncmp(dir->d_name, "cu.", 3) == 0) {
-                snprintf(path, sizeof(path), "/dev/%s", dir->d_name);
-                printf("Checking %s at 19200 baud...\n", path);
-                
-                if (check_arduinoisp(path)) {
-                    printf("ArduinoISP found on %s at 19200 baud\n", path);
-                    closedir(d);
-                    return 0;
-                }
+                snprintf(paths[count], MAX_PATH, "/dev/%s", dir->d_name);
+                printf("Checking %s at %d baud...\n", paths[count], ARDUINOISP_BAUD);
+                count++;
             }
         }
         closedir(d);
     }
 
-    printf("ArduinoISP not found on any port at 19200 baud.\n");
+    int found = find_arduinoisp(paths, count);
+    if (found >= 0) {
+        printf("ArduinoISP found on %s at %d baud\n", paths[found], ARDUINOISP_BAUD);
+        return 0;
+    }
+
+    printf("ArduinoISP not found on any port at %d baud.\n", ARDUINOISP_BAUD);
     return 1;
 }
\ No newline at end of file
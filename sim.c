@@ -0,0 +1,535 @@
+#include <cosmo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// A software ArduinoISP with an ATtiny85 behind it, on a pseudo-terminal.
+// Point an uploader at the printed port (upload --port, win.c, mac.c) to test
+// it or benchmark the protocol without hardware. The command handling follows
+// ArduinoISP's avrisp() byte for byte, including how it answers commands it
+// does not know, and the target is emulated at the level of ISP instructions.
+// --corrupt and --drop break a single reply to exercise an uploader's recovery.
+
+#define STK_OK              0x10
+#define STK_FAILED          0x11
+#define STK_UNKNOWN         0x12
+#define STK_INSYNC          0x14
+#define STK_NOSYNC          0x15
+#define CRC_EOP             0x20
+
+#define STK_GET_SYNC       '0'
+#define STK_GET_SIGN_ON    '1'
+#define STK_SET_PARAMETER  '@'
+#define STK_GET_PARAMETER  'A'
+#define STK_SET_DEVICE     'B'
+#define STK_SET_DEVICE_EXT 'E'
+#define STK_ENTER_PROGMODE 'P'
+#define STK_LEAVE_PROGMODE 'Q'
+#define STK_LOAD_ADDRESS   'U'
+#define STK_UNIVERSAL      'V'
+#define STK_PROG_PAGE      'd'
+#define STK_READ_PAGE      't'
+#define STK_READ_SIGN      'u'
+
+// ATtiny85
+#define SIM_FLASH_SIZE      8192
+#define SIM_EEPROM_SIZE     512
+#define SIM_SIGNATURE       {0x1E, 0x93, 0x0B}
+#define SIM_LFUSE           0x62    // factory defaults
+#define SIM_HFUSE           0xDF
+#define SIM_EFUSE           0xFF
+#define SIM_HFUSE_EESAVE    0x08    // programmed (0) keeps the EEPROM through a chip erase
+
+#define SIM_HW_VERSION      2       // what ArduinoISP reports for STK_GET_PARAMETER
+#define SIM_SW_MAJOR        1
+#define SIM_SW_MINOR        18
+#define SIM_MAX_REPLY       (256 + 2)
+#define SIM_LINK_ENV        "M_SIM_PORT"
+
+typedef struct {
+    unsigned char flash[SIM_FLASH_SIZE];
+    unsigned char eeprom[SIM_EEPROM_SIZE];
+    unsigned char lfuse, hfuse, efuse, lock;
+    int pmode;
+    unsigned int here;          // word address from STK_LOAD_ADDRESS
+} target_t;
+
+// Link timing: bytes cost byte_us each way; replies leave on the next USB frame
+// boundary (frame_us, 0 = immediately) plus up to jitter_us of random delay
+typedef struct {
+    int byte_us;
+    int frame_us;
+    int jitter_us;
+    int accept_parameters;      // answer STK_SET_PARAMETER like STK500 firmware does
+    int verbose;
+    int fault_reply;            // the Nth reply (1-based, 0 = none) is corrupted or dropped
+    int fault_drop;             // drop it instead of corrupting its last byte
+    int fault_command;          // only count replies to this command (0 = every reply)
+} options_t;
+
+typedef struct {
+    unsigned long commands;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long pages_written;
+    unsigned long pages_read;
+} stats_t;
+
+static target_t target;
+static options_t options;
+static stats_t stats;
+static int master_fd = -1;
+static long long rx_done_us;    // when the link finishes receiving what was read so far
+static long long tx_done_us;    // when the last reply finishes leaving
+static volatile sig_atomic_t stop_requested;
+static int current_command;     // the command avrisp() is answering
+static int replies_counted;     // replies that matched options.fault_command so far
+static const char *dump_path;
+static const char *link_path;
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(long long when) {
+    long long wait = when - now_us();
+    if (wait > 0) usleep(wait);
+}
+
+static void reset_target(void) {
+    memset(target.flash, 0xFF, sizeof(target.flash));
+    memset(target.eeprom, 0xFF, sizeof(target.eeprom));
+    target.lfuse = SIM_LFUSE;
+    target.hfuse = SIM_HFUSE;
+    target.efuse = SIM_EFUSE;
+    target.lock = 0xFF;
+}
+
+// Blocks for the next byte from the uploader. A closed slave (the uploader
+// exited) just means waiting for the next one to open it.
+static int getch(void) {
+    unsigned char c;
+    for (;;) {
+        if (stop_requested) return -1;
+        ssize_t n = read(master_fd, &c, 1);
+        if (n == 1) break;
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EIO) return -1;
+        usleep(1000);
+    }
+    long long now = now_us();
+    rx_done_us = (rx_done_us > now ? rx_done_us : now) + options.byte_us;
+    stats.bytes_in++;
+    return c;
+}
+
+static void fill(unsigned char *buf, int length) {
+    for (int i = 0; i < length; i++) {
+        buf[i] = getch();
+    }
+}
+
+// Applies --corrupt/--drop to the reply about to be sent. Returns 0 if it is
+// dropped; a corrupted reply has its last byte (normally STK_OK) inverted.
+static int inject_fault(unsigned char *bytes, int length) {
+    if (options.fault_reply == 0 || length == 0) return 1;
+    if (options.fault_command && current_command != options.fault_command) return 1;
+    if (++replies_counted != options.fault_reply) return 1;
+    fprintf(stderr, "%s reply %d to 0x%02X, here=0x%04X\n", options.fault_drop ? "Dropping" : "Corrupting",
+            replies_counted, current_command, target.here);
+    if (options.fault_drop) return 0;
+    bytes[length - 1] ^= 0xFF;
+    return 1;
+}
+
+static void reply(const unsigned char *data, int length) {
+    unsigned char bytes[SIM_MAX_REPLY];
+    if (length > (int)sizeof(bytes)) length = sizeof(bytes);
+    memcpy(bytes, data, length);
+    if (!inject_fault(bytes, length)) return;
+
+    // The firmware only sees a command once all of it has arrived
+    sleep_until(rx_done_us);
+    long long ready = now_us();
+    if (tx_done_us > ready) ready = tx_done_us;
+    ready += (long long)length * options.byte_us;
+    if (options.frame_us > 0) ready = (ready + options.frame_us - 1) / options.frame_us * options.frame_us;
+    if (options.jitter_us > 0) ready += rand() % (options.jitter_us + 1);
+    sleep_until(ready);
+    tx_done_us = ready;
+
+    for (int sent = 0; sent < length; ) {
+        ssize_t n = write(master_fd, bytes + sent, length - sent);
+        if (n <= 0) {
+            if (n < 0 && errno != EINTR && errno != EAGAIN) return;
+            usleep(1000);
+            continue;
+        }
+        sent += n;
+    }
+    stats.bytes_out += length;
+}
+
+static void reply_byte(unsigned char c) {
+    reply(&c, 1);
+}
+
+// ArduinoISP's empty_reply()/breply(): INSYNC [b] OK if the frame ends in CRC_EOP
+static void empty_reply(void) {
+    if (getch() == CRC_EOP) {
+        unsigned char ok[] = {STK_INSYNC, STK_OK};
+        reply(ok, sizeof(ok));
+    } else {
+        reply_byte(STK_NOSYNC);
+    }
+}
+
+static void byte_reply(unsigned char b) {
+    if (getch() == CRC_EOP) {
+        unsigned char ok[] = {STK_INSYNC, b, STK_OK};
+        reply(ok, sizeof(ok));
+    } else {
+        reply_byte(STK_NOSYNC);
+    }
+}
+
+// One 4-byte ISP instruction as the target would answer it on MISO's last byte
+static unsigned char isp(unsigned char a, unsigned char b, unsigned char c, unsigned char d) {
+    static const unsigned char signature[] = SIM_SIGNATURE;
+    unsigned int word = ((b << 8) | c) % (SIM_FLASH_SIZE / 2);
+    unsigned int byte = ((b << 8) | c) % SIM_EEPROM_SIZE;
+    if (!target.pmode) return 0x00;
+
+    switch (a) {
+        case 0x30: return (c & 3) < 3 ? signature[c & 3] : 0xFF;
+        case 0x50: return b == 0x08 ? target.efuse : target.lfuse;
+        case 0x58: return b == 0x08 ? target.hfuse : target.lock;
+        case 0x20: return target.flash[word * 2];
+        case 0x28: return target.flash[word * 2 + 1];
+        case 0x40: target.flash[(word * 2) % SIM_FLASH_SIZE] &= d; return 0;        // load page, low byte
+        case 0x48: target.flash[(word * 2 + 1) % SIM_FLASH_SIZE] &= d; return 0;    // load page, high byte
+        case 0x4C: return 0;                                                        // write page
+        case 0xA0: return target.eeprom[byte];
+        case 0xC0: target.eeprom[byte] = d; return 0;
+        case 0xAC:
+            switch (b) {
+                case 0x80:
+                    memset(target.flash, 0xFF, sizeof(target.flash));
+                    if (target.hfuse & SIM_HFUSE_EESAVE) memset(target.eeprom, 0xFF, sizeof(target.eeprom));
+                    target.lock = 0xFF;
+                    break;
+                case 0xA0: target.lfuse = d; break;
+                case 0xA8: target.hfuse = d; break;
+                case 0xA4: target.efuse = d | 0xFE; break;  // only SELFPRGEN is implemented
+                case 0xE0: target.lock &= d | 0xFC; break;  // lock bits only ever get programmed
+            }
+            return 0;
+    }
+    return 0;
+}
+
+// ArduinoISP's program_page(): flash is written a byte pair at a time with the
+// ISP load instructions (which can only clear bits) and here advances past the
+// page, EEPROM a byte at a time from byte address here * 2 with here unchanged
+static void program_page(void) {
+    static unsigned char buf[256];
+    int length = getch() << 8;
+    length |= getch();
+    int memtype = getch();
+    if (length > (int)sizeof(buf)) {
+        reply_byte(STK_FAILED);
+        return;
+    }
+    fill(buf, length);
+    if (getch() != CRC_EOP) {
+        reply_byte(STK_NOSYNC);
+        return;
+    }
+
+    unsigned char result = STK_OK;
+    if (memtype == 'F') {
+        for (int i = 0; i < length; i++) {
+            unsigned int addr = (target.here * 2 + i) % SIM_FLASH_SIZE;
+            isp(addr & 1 ? 0x48 : 0x40, addr >> 9, (addr >> 1) & 0xFF, buf[i]);
+        }
+        isp(0x4C, target.here >> 8, target.here & 0xFF, 0);
+        target.here += length / 2;
+    } else if (memtype == 'E' && target.here * 2 + length <= SIM_EEPROM_SIZE) {
+        for (int i = 0; i < length; i++) {
+            unsigned int addr = target.here * 2 + i;
+            isp(0xC0, addr >> 8, addr & 0xFF, buf[i]);
+        }
+    } else {
+        result = STK_FAILED;
+    }
+    stats.pages_written++;
+    unsigned char ok[] = {STK_INSYNC, result};
+    reply(ok, sizeof(ok));
+}
+
+// ArduinoISP's read_page(): like program_page(), a flash read advances here
+// past the page and an EEPROM read does not
+static void read_page(void) {
+    static unsigned char buf[SIM_MAX_REPLY];
+    int length = getch() << 8;
+    length |= getch();
+    int memtype = getch();
+    if (getch() != CRC_EOP) {
+        reply_byte(STK_NOSYNC);
+        return;
+    }
+
+    buf[0] = STK_INSYNC;
+    if (length > 256 || (memtype != 'F' && memtype != 'E')) {
+        buf[1] = STK_FAILED;
+        reply(buf, 2);
+        return;
+    }
+    for (int i = 0; i < length; i++) {
+        unsigned int addr = target.here * 2 + i;
+        buf[1 + i] = memtype == 'F' ? target.flash[addr % SIM_FLASH_SIZE] : target.eeprom[addr % SIM_EEPROM_SIZE];
+    }
+    if (memtype == 'F') target.here += length / 2;
+    buf[1 + length] = STK_OK;
+    stats.pages_read++;
+    reply(buf, length + 2);
+}
+
+static void get_parameter(unsigned char parameter) {
+    switch (parameter) {
+        case 0x80: byte_reply(SIM_HW_VERSION); break;
+        case 0x81: byte_reply(SIM_SW_MAJOR); break;
+        case 0x82: byte_reply(SIM_SW_MINOR); break;
+        case 0x93: byte_reply('S'); break;          // serial programmer
+        default: byte_reply(0); break;
+    }
+}
+
+static const char *command_name(int ch) {
+    switch (ch) {
+        case STK_GET_SYNC: return "GET_SYNC";
+        case STK_GET_SIGN_ON: return "GET_SIGN_ON";
+        case STK_SET_PARAMETER: return "SET_PARAMETER";
+        case STK_GET_PARAMETER: return "GET_PARAMETER";
+        case STK_SET_DEVICE: return "SET_DEVICE";
+        case STK_SET_DEVICE_EXT: return "SET_DEVICE_EXT";
+        case STK_ENTER_PROGMODE: return "ENTER_PROGMODE";
+        case STK_LEAVE_PROGMODE: return "LEAVE_PROGMODE";
+        case STK_LOAD_ADDRESS: return "LOAD_ADDRESS";
+        case STK_UNIVERSAL: return "UNIVERSAL";
+        case STK_PROG_PAGE: return "PROG_PAGE";
+        case STK_READ_PAGE: return "READ_PAGE";
+        case STK_READ_SIGN: return "READ_SIGN";
+        default: return "unknown";
+    }
+}
+
+// ArduinoISP's avrisp(): one command per call
+static int avrisp(void) {
+    unsigned char buf[20];
+    int ch = getch();
+    if (ch < 0) return 0;
+    current_command = ch;
+    stats.commands++;
+    if (options.verbose) fprintf(stderr, "%-15s 0x%02X  here=0x%04X\n", command_name(ch), ch, target.here);
+
+    switch (ch) {
+        case STK_GET_SYNC:
+            empty_reply();
+            break;
+        case STK_GET_SIGN_ON:
+            if (getch() == CRC_EOP) {
+                reply((const unsigned char *)"\x14" "AVR ISP" "\x10", 9);
+            } else {
+                reply_byte(STK_NOSYNC);
+            }
+            break;
+        case STK_GET_PARAMETER:
+            get_parameter(getch());
+            break;
+        case STK_SET_PARAMETER:
+            if (!options.accept_parameters) goto unknown;
+            fill(buf, 2);
+            empty_reply();
+            break;
+        case STK_SET_DEVICE:
+            fill(buf, 20);
+            empty_reply();
+            break;
+        case STK_SET_DEVICE_EXT:
+            fill(buf, 5);
+            empty_reply();
+            break;
+        case STK_ENTER_PROGMODE:
+            target.pmode = 1;
+            empty_reply();
+            break;
+        case STK_LEAVE_PROGMODE:
+            target.pmode = 0;
+            empty_reply();
+            break;
+        case STK_LOAD_ADDRESS:
+            target.here = getch();
+            target.here |= getch() << 8;
+            empty_reply();
+            break;
+        case STK_UNIVERSAL:
+            fill(buf, 4);
+            byte_reply(isp(buf[0], buf[1], buf[2], buf[3]));
+            break;
+        case STK_PROG_PAGE:
+            program_page();
+            break;
+        case STK_READ_PAGE:
+            read_page();
+            break;
+        case STK_READ_SIGN:
+            if (getch() == CRC_EOP) {
+                static const unsigned char signature[] = SIM_SIGNATURE;
+                unsigned char out[] = {STK_INSYNC, signature[0], signature[1], signature[2], STK_OK};
+                reply(out, sizeof(out));
+            } else {
+                reply_byte(STK_NOSYNC);
+            }
+            break;
+        case CRC_EOP:
+            // Expecting a command, not CRC_EOP; this is how ArduinoISP gets back in sync
+            reply_byte(STK_NOSYNC);
+            break;
+        default:
+        unknown:
+            reply_byte(getch() == CRC_EOP ? STK_UNKNOWN : STK_NOSYNC);
+            break;
+    }
+    return 1;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static int open_pty(char *name, size_t size) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+        return -1;
+    }
+    snprintf(name, size, "%s", ptsname(fd));
+
+    // Hold the slave open in raw mode, so uploaders that come and go see a
+    // clean 8-bit line and the master does not hang up between them
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        close(fd);
+        return -1;
+    }
+    struct termios tty;
+    tcgetattr(slave, &tty);
+    cfmakeraw(&tty);
+    cfsetispeed(&tty, B19200);
+    cfsetospeed(&tty, B19200);
+    tcsetattr(slave, TCSANOW, &tty);
+    return fd;
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --byte-us N      link time per byte, e.g. 521 for 19200 baud (default 0)\n"
+        "  --frame-us N     hold replies to USB frame boundaries, e.g. 1000 (default 0)\n"
+        "  --jitter-us N    add up to N us of random delay to each reply (default 0)\n"
+        "  --seed N         seed for the jitter\n"
+        "  --sck            accept STK_SET_PARAMETER like STK500 firmware (ArduinoISP does not)\n"
+        "  --link PATH      also expose the port as a symlink at PATH (or $%s)\n"
+        "  --dump PATH      write the emulated flash to PATH on exit\n"
+        "  --corrupt N      invert the last byte of the Nth reply, e.g. STK_OK\n"
+        "  --drop N         never send the Nth reply, as if it were lost on the link\n"
+        "  --fault-on C     count only replies to command C for --corrupt/--drop, e.g. d\n"
+        "  -v               log every command to stderr\n",
+        program, SIM_LINK_ENV);
+}
+
+int main(int argc, char *argv[]) {
+    link_path = getenv(SIM_LINK_ENV);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--byte-us") == 0 && i + 1 < argc) {
+            options.byte_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frame-us") == 0 && i + 1 < argc) {
+            options.frame_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--jitter-us") == 0 && i + 1 < argc) {
+            options.jitter_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            srand(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--sck") == 0) {
+            options.accept_parameters = 1;
+        } else if (strcmp(argv[i], "--link") == 0 && i + 1 < argc) {
+            link_path = argv[++i];
+        } else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+            dump_path = argv[++i];
+        } else if (strcmp(argv[i], "--corrupt") == 0 && i + 1 < argc) {
+            options.fault_reply = atoi(argv[++i]);
+            options.fault_drop = 0;
+        } else if (strcmp(argv[i], "--drop") == 0 && i + 1 < argc) {
+            options.fault_reply = atoi(argv[++i]);
+            options.fault_drop = 1;
+        } else if (strcmp(argv[i], "--fault-on") == 0 && i + 1 < argc) {
+            options.fault_command = (unsigned char)argv[++i][0];
+        } else if (strcmp(argv[i], "-v") == 0) {
+            options.verbose = 1;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    char port[64];
+    master_fd = open_pty(port, sizeof(port));
+    if (master_fd < 0) {
+        fprintf(stderr, "Cannot open a pseudo-terminal: %s\n", strerror(errno));
+        return 1;
+    }
+    if (link_path) {
+        unlink(link_path);
+        if (symlink(port, link_path) != 0) {
+            fprintf(stderr, "Cannot link %s: %s\n", link_path, strerror(errno));
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;  // no SA_RESTART, so a blocked read returns
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    reset_target();
+    printf("Simulated ArduinoISP with ATtiny85 on %s%s%s\n", port, link_path ? " -> " : "", link_path ? link_path : "");
+    printf("byte %d us, USB frame %d us, jitter %d us%s\n", options.byte_us, options.frame_us, options.jitter_us,
+           options.accept_parameters ? ", STK_SET_PARAMETER accepted" : "");
+    fflush(stdout);
+
+    long long start = now_us();
+    while (avrisp()) {
+    }
+
+    double seconds = (now_us() - start) / 1e6;
+    printf("\n%lu commands, %lu bytes in, %lu bytes out, %lu pages written, %lu read in %.1f s\n",
+           stats.commands, stats.bytes_in, stats.bytes_out, stats.pages_written, stats.pages_read, seconds);
+    printf("lfuse 0x%02X  hfuse 0x%02X  efuse 0x%02X  lock 0x%02X\n", target.lfuse, target.hfuse, target.efuse, target.lock);
+    if (dump_path) {
+        FILE *fp = fopen(dump_path, "wb");
+        if (fp) {
+            fwrite(target.flash, 1, sizeof(target.flash), fp);
+            fclose(fp);
+        }
+    }
+    if (link_path) unlink(link_path);
+    close(master_fd);
+    return 0;
+}
@@ -0,0 +1,112 @@
+#!/bin/bash
+
+# Uploads a test image through sim.c with one reply corrupted or dropped at a
+# time and checks the flash the simulated target ends up with. This exercises
+# the pipeline's stop-and-wait fallback, resync and replay, which a clean link
+# never reaches. It then backs EEPROM up, changes it and restores the backup.
+# CC overrides the compiler, e.g. CC=gcc ./sim_test.sh
+
+CC=${CC:-"./.tool/bin/cosmocc -I./.tool/include"}
+root=$(pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+$CC -g0 -o "$dir/sim" sim.c || exit 1
+$CC -g0 -o "$dir/upload" upload.c -lpthread || exit 1
+
+# 3000 random bytes, so the image spans many pages and a wrong page shows, and
+# two EEPROM images: a few bytes near the start, and all 512 bytes
+head -c 3000 /dev/urandom > "$dir/image.bin"
+head -c 40 /dev/urandom > "$dir/ee1.bin"
+head -c 512 /dev/urandom > "$dir/ee2.bin"
+for name in image ee1 ee2; do
+python3 - "$dir/$name.bin" "$dir/$name.hex" <<'EOF'
+import sys
+data = open(sys.argv[1], 'rb').read()
+with open(sys.argv[2], 'w') as out:
+    for addr in range(0, len(data), 16):
+        chunk = data[addr:addr + 16]
+        record = bytes([len(chunk), addr >> 8, addr & 0xFF, 0]) + chunk
+        out.write(':%s%02X\n' % (record.hex().upper(), -sum(record) & 0xFF))
+    out.write(':00000001FF\n')
+EOF
+done
+
+export M_AVRDUDE_CONF="$root/resource/linux/avrdude/avrdude.conf"
+cd "$dir"
+failed=0
+sim_pid=
+
+start_sim() {
+    rm -rf .cache flash.bin
+    ./sim --link "$dir/port" --dump flash.bin "$@" > sim.log 2>&1 &
+    sim_pid=$!
+    sleep 0.5
+}
+
+stop_sim() {
+    kill -INT $sim_pid
+    wait $sim_pid
+}
+
+upload() {
+    timeout 30 ./upload --port "$dir/port" "$@" >> upload.log 2>&1
+}
+
+# report <name> <passed>
+report() {
+    if [ "$2" = 1 ]; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        sed 's/^/      /' upload.log sim.log
+        failed=1
+    fi
+    : > upload.log
+}
+
+# run <window> <sim fault options...>
+run() {
+    local window=$1
+    shift
+    start_sim "$@"
+    upload -w "$window" image.hex
+    local code=$?
+    stop_sim
+    local passed=0
+    if [ $code -eq 0 ] && cmp -s <(head -c 3000 flash.bin) image.bin; then
+        passed=1
+    fi
+    report "-w $window $*" $passed
+}
+
+# restore_eeprom <first EEPROM image or "erased"> <name>: backs the EEPROM up as
+# HEX, overwrites all of it, restores the backup and checks it reads back the same
+restore_eeprom() {
+    start_sim
+    if [ "$1" != erased ]; then
+        upload --eeprom "$1.hex" image.hex
+    fi
+    local passed=0
+    if upload read eeprom backup.hex && upload read eeprom before.bin &&
+       upload --eeprom ee2.hex image.hex &&
+       upload restore eeprom backup.hex && upload read eeprom after.bin &&
+       cmp -s before.bin after.bin; then
+        passed=1
+    fi
+    stop_sim
+    report "$2" $passed
+}
+
+for window in 1 4; do
+    run $window
+    run $window --corrupt 10 --fault-on d
+    run $window --drop 10 --fault-on d
+    run $window --corrupt 7 --fault-on U
+    run $window --corrupt 5 --fault-on t
+    run $window --drop 5 --fault-on t
+done
+restore_eeprom ee1 "EEPROM backup, change, restore"
+restore_eeprom erased "erased EEPROM backup, change, restore"
+
+exit $failed
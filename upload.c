@@ -2,564 +2,379 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <unistd.h>
-#include <sys/select.h>
-#include <dirent.h>
-#include <termios.h>
-#include "libc/dce.h"
+#include <pthread.h>
 
-// STK500v1 constants
-#define STK_START           0x1B
-#define STK_GET_SYNC       'A'
-#define STK_GET_SIGN_ON    'B'
-#define STK_SET_PARAMETER  'A'
-#define STK_GET_PARAMETER  'B'
-#define STK_SET_DEVICE     'E'
-#define STK_ENTER_PROGMODE 'P'
-#define STK_LEAVE_PROGMODE 'Q'
-#define STK_CHIP_ERASE     'R'
-#define STK_CHECK_AUTOINC  'S'
-#define STK_LOAD_ADDRESS   'U'
-#define STK_PROG_FLASH     'V'
-#define STK_PROG_DATA      'W'
-#define STK_PROG_FUSE      'X'
-#define STK_PROG_LOCK      'Y'
-#define STK_READ_FLASH     'Z'
-#define STK_READ_DATA      '['
-#define STK_READ_FUSE      '\\'
-#define STK_READ_LOCK      ']'
-#define STK_READ_PAGE      '^'
-#define STK_READ_SIGN      '_'
-#define STK_UNIVERSAL      'V'
-#define STK_SW_MAJOR       '`'
-#define STK_SW_MINOR       'a'
+#include "lib/stk500.h"
 
-#define STK_OK              0x10
-#define STK_FAILED          0x11
-#define STK_UNKNOWN         0x12
-#define STK_NODEVICE        0x13
-#define STK_INSYNC          0x14
-#define STK_NOSYNC          0x15
-
-#define CRC_EOP             0x20
-
-// Intel HEX record types
-#define DATA_RECORD         0x00
-#define END_OF_FILE         0x01
-#define EXT_SEGMENT_ADDR    0x02
-#define START_SEGMENT_ADDR  0x03
-#define EXT_LINEAR_ADDR     0x04
-#define START_LINEAR_ADDR   0x05
-
-// ATtiny85 specific
-#define ATTINY85_SIGNATURE_0 0x1E
-#define ATTINY85_SIGNATURE_1 0x93
-#define ATTINY85_SIGNATURE_2 0x0B
-
-// Timeouts and delays
-#define INIT_DELAY_US       2000000
-#define STABILIZE_DELAY_US  50000
-#define READ_TIMEOUT_US     500000
-#define SYNC_ATTEMPTS       3
-#define PAGE_SIZE           64  // ATtiny85 page size
-
-// Buffer sizes
-#define MAX_PORTS           64
-#define PORT_NAME_LENGTH    32
-#define HEX_LINE_LENGTH     256
-#define RESPONSE_BUFFER     275
+#define MAX_FUSE_ARGS 8
+#define FUSE_LINE_LENGTH 64
+#define GANG_REFRESH_US 100000
+#define GANG_MESSAGE_LENGTH 48
 
 typedef struct {
-    unsigned char data[PAGE_SIZE];
-    unsigned int address;
-    size_t length;
-} Page;
-
-int wait_for_data(int fd, int timeout_us) {
-    fd_set readfds;
-    struct timeval tv;
-    
-    FD_ZERO(&readfds);
-    FD_SET(fd, &readfds);
-    
-    tv.tv_sec = timeout_us / 1000000;
-    tv.tv_usec = timeout_us % 1000000;
-    
-    return select(fd + 1, &readfds, NULL, NULL, &tv);
+    const char *part_name;
+    const char **fuse_args;
+    int fuse_count;
+    const stk500_image_t *image;
+    const char *eeprom_file;
+    const char *stats_json;     // per-port telemetry goes to <stats_json>.<port number>
+    stk500_mode_t mode;
+    int verify;
+    int window;
+} gang_job_t;
+
+// One programmer's row in the status table; workers write it under gang_lock
+typedef struct {
+    int index;
+    stk500_port_t port;
+    const gang_job_t *job;
+    pthread_t thread;
+    int started;
+    const char *stage;
+    int done;
+    int total;
+    double eta_s;           // of the current stage, -1 while unknown
+    char message[GANG_MESSAGE_LENGTH];
+    long long start_us;
+    long long end_us;
+    int result;             // -1 while running, then 0 or 1
+} gang_slot_t;
+
+static pthread_mutex_t gang_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local gang_slot_t *gang_current;
+
+// Writes the fuses given as name=value, e.g. lfuse=0xE2. Returns the failing argument, or NULL.
+static const char *write_fuses(const char **fuse_args, int fuse_count) {
+    for (int i = 0; i < fuse_count; i++) {
+        char name[16];
+        int value;
+        if (sscanf(fuse_args[i], "%15[^=]=%i", name, &value) != 2 || !stk500.write_fuse(name, value)) {
+            return fuse_args[i];
+        }
+    }
+    return NULL;
 }
 
-int read_with_timeout(int fd, unsigned char *buf, size_t size, int timeout_us) {
-    int result = wait_for_data(fd, timeout_us);
-    if (result > 0) {
-        return read(fd, buf, size);
-    }
-    return result;
+// Backups and restores are raw binary for .bin/.raw files, Intel HEX otherwise
+static int is_raw_file(const char *path) {
+    const char *ext = strrchr(path, '.');
+    return ext && (strcasecmp(ext, ".bin") == 0 || strcasecmp(ext, ".raw") == 0);
 }
 
-int configure_port(const char *port) {
-    if (IsWindows()) {
-        char cmd[256];
-        snprintf(cmd, sizeof(cmd), 
-            "cmd.exe /c mode %s: BAUD=19200 PARITY=N DATA=8 STOP=1 dtr=on rts=on", port);
-        return system(cmd);
-    }
+static char memory_type(const char *memory) {
+    if (strcmp(memory, "flash") == 0) return 'F';
+    if (strcmp(memory, "eeprom") == 0) return 'E';
+    if (strcmp(memory, "fuses") == 0) return 'f';
     return 0;
 }
 
-int open_port(const char *port) {
-    if (IsWindows()) {
-        if (configure_port(port) != 0) {
-            return -1;
-        }
-        
-        // Open port with both read and write access
-        int fd = open(port, O_RDWR | O_NONBLOCK);
-        if (fd < 0) return -1;
-
-        // Set DTR and RTS using Windows API
-        HANDLE hComm = (HANDLE)_get_osfhandle(fd);
-        if (hComm == INVALID_HANDLE_VALUE) {
-            close(fd);
-            return -1;
+// `read flash|eeprom FILE` streams the whole memory out; `read fuses FILE` writes
+// name=value lines in the syntax of --fuse
+static int backup(const char *memory, const char *path) {
+    char type = memory_type(memory);
+    if (type == 'f') {
+        FILE *fp = fopen(path, "w");
+        if (fp == NULL) {
+            printf("Cannot create %s\n", path);
+            return 0;
         }
-
-        // Assert DTR and RTS
-        EscapeCommFunction(hComm, SETDTR);
-        EscapeCommFunction(hComm, SETRTS);
-        
-        // Reset pulse
-        usleep(250000);  // 250ms delay
-        EscapeCommFunction(hComm, CLRDTR);
-        usleep(50000);   // 50ms delay
-        EscapeCommFunction(hComm, SETDTR);
-
-        return fd;
-    } else {
-        int fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
-        if (fd < 0) return -1;
-
-        struct termios tty;
-        memset(&tty, 0, sizeof(tty));
-        if (tcgetattr(fd, &tty) != 0) {
-            close(fd);
-            return -1;
+        int ok = 1;
+        for (int i = 0; ok && i < stk500.part->fuse_count; i++) {
+            unsigned char value;
+            const char *name = stk500.part->fuses[i].name;
+            if (stk500.part->fuses[i].read[0] == 0) continue;
+            ok = stk500.read_fuse(name, &value);
+            if (ok) fprintf(fp, "%s=0x%02X\n", name, value);
         }
+        fclose(fp);
+        return ok;
+    }
 
-        cfsetispeed(&tty, B19200);
-        cfsetospeed(&tty, B19200);
-        tty.c_cflag |= (CS8 | CLOCAL | CREAD);
-        tty.c_cflag &= ~(PARENB | CSTOPB | CRTSCTS);
-        tty.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-        tty.c_iflag &= ~(IXON | IXOFF | IXANY);
-        tty.c_oflag &= ~OPOST;
-
-        // Set DTR and RTS on POSIX systems
-        int bits;
-        ioctl(fd, TIOCMGET, &bits);
-        bits |= TIOCM_DTR | TIOCM_RTS;
-        ioctl(fd, TIOCMSET, &bits);
-
-        if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-            close(fd);
-            return -1;
+    stk500_image_t *image = malloc(sizeof(stk500_image_t));
+    long long start = serial.now();
+    int ok = image && stk500.read_memory(type, image);
+    if (ok) {
+        double seconds = (serial.now() - start) / 1e6;
+        printf("Read %u bytes of %s in %.2f s (%.0f B/s, the line carries %d B/s)\n", image->top, memory, seconds,
+               image->top / seconds, STK500_BAUD / STK500_BITS_PER_BYTE);
+        if (hex.save(path, image, is_raw_file(path)) != 0) {
+            printf("%s\n", hex.error());
+            ok = 0;
         }
-
-        // Reset pulse
-        bits &= ~TIOCM_DTR;
-        ioctl(fd, TIOCMSET, &bits);
-        usleep(50000);  // 50ms delay
-        bits |= TIOCM_DTR;
-        ioctl(fd, TIOCMSET, &bits);
-
-        return fd;
     }
+    free(image);
+    return ok;
 }
 
-int get_available_ports(char ports[][PORT_NAME_LENGTH]) {
-    int count = 0;
-
-    if (IsWindows()) {
-        // Windows: Check COM1 through COM20
-        for (int i = 1; i <= 20 && count < MAX_PORTS; i++) {
-            snprintf(ports[count], PORT_NAME_LENGTH, "COM%d", i);
-            int fd = open(ports[count], O_RDWR | O_NONBLOCK);
-            if (fd >= 0) {
-                close(fd);
-                count++;
-            }
-        }
-    } else if (IsXnu()) {
-        // macOS: Check /dev/cu.* devices
-        DIR *dir = opendir("/dev");
-        if (dir) {
-            struct dirent *entry;
-            while ((entry = readdir(dir)) != NULL && count < MAX_PORTS) {
-                if (strncmp(entry->d_name, "cu.", 3) == 0) {
-                    snprintf(ports[count], PORT_NAME_LENGTH, "/dev/%s", entry->d_name);
-                    count++;
-                }
-            }
-            closedir(dir);
-        }
-    } else if (IsLinux()) {
-        // Linux: Check /dev/ttyUSB* and /dev/ttyACM*
-        DIR *dir = opendir("/dev");
-        if (dir) {
-            struct dirent *entry;
-            while ((entry = readdir(dir)) != NULL && count < MAX_PORTS) {
-                if (strncmp(entry->d_name, "ttyUSB", 6) == 0 ||
-                    strncmp(entry->d_name, "ttyACM", 6) == 0) {
-                    snprintf(ports[count], PORT_NAME_LENGTH, "/dev/%s", entry->d_name);
-                    count++;
-                }
-            }
-            closedir(dir);
+// Writes back what backup() saved
+static int restore(const char *memory, const char *path, stk500_mode_t mode, int verify) {
+    char type = memory_type(memory);
+    if (type == 'f') {
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) {
+            printf("Cannot open %s\n", path);
+            return 0;
         }
-    } else if (IsBsd()) {
-        // BSD: Check /dev/cuaU* devices
-        DIR *dir = opendir("/dev");
-        if (dir) {
-            struct dirent *entry;
-            while ((entry = readdir(dir)) != NULL && count < MAX_PORTS) {
-                if (strncmp(entry->d_name, "cuaU", 4) == 0) {
-                    snprintf(ports[count], PORT_NAME_LENGTH, "/dev/%s", entry->d_name);
-                    count++;
-                }
-            }
-            closedir(dir);
+        char line[FUSE_LINE_LENGTH];
+        const char *failed = NULL;
+        while (failed == NULL && fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\r\n")] = 0;
+            const char *arg = line;
+            if (line[0] && line[0] != '#') failed = write_fuses(&arg, 1);
         }
+        fclose(fp);
+        if (failed) printf("Fuse %s failed\n", failed);
+        return failed == NULL;
     }
 
-    return count;
+    stk500_image_t *image = malloc(sizeof(stk500_image_t));
+    int loaded = image && (is_raw_file(path) ? hex.load_raw(path, image) : hex.load(path, image)) == 0;
+    if (image && !loaded) printf("Failed to load %s: %s\n", path, hex.error());
+    int ok = loaded && (type == 'F' ? stk500.flash_image(image, mode, verify) : stk500.eeprom_image(image, verify));
+    free(image);
+    return ok;
 }
 
-int send_command(int fd, unsigned char *cmd, size_t cmd_len, unsigned char *response, size_t resp_len) {
-    if (write(fd, cmd, cmd_len) != cmd_len) {
-        return 0;
-    }
-    
-    usleep(STABILIZE_DELAY_US);
-    
-    int bytes_read = read_with_timeout(fd, response, resp_len, READ_TIMEOUT_US);
-    if (bytes_read < 2 || response[0] != STK_INSYNC || response[bytes_read-1] != STK_OK) {
-        return 0;
-    }
-    
-    return bytes_read;
+static void gang_stage(const char *stage, int done, int total) {
+    pthread_mutex_lock(&gang_lock);
+    gang_current->stage = stage;
+    gang_current->done = done;
+    gang_current->total = total;
+    gang_current->eta_s = -1;
+    pthread_mutex_unlock(&gang_lock);
 }
 
-int sync_programmer(int fd) {
-    // Add manual sync sequence
-    if (IsWindows()) {
-        HANDLE hComm = (HANDLE)_get_osfhandle(fd);
-        EscapeCommFunction(hComm, CLRDTR);
-        usleep(50000);
-        EscapeCommFunction(hComm, SETDTR);
-    } else {
-        int bits;
-        ioctl(fd, TIOCMGET, &bits);
-        bits &= ~TIOCM_DTR;
-        ioctl(fd, TIOCMSET, &bits);
-        usleep(50000);
-        bits |= TIOCM_DTR;
-        ioctl(fd, TIOCMSET, &bits);
-    }
-    
-    // Clear any pending data
-    unsigned char buf[128];
-    while (read_with_timeout(fd, buf, sizeof(buf), 100000) > 0) {
-        // Discard data
-    }
-    
-    unsigned char cmd[] = {STK_GET_SYNC, CRC_EOP};
-    unsigned char response[2];
-    
-    for (int i = 0; i < SYNC_ATTEMPTS; i++) {
-        if (write(fd, cmd, sizeof(cmd)) == sizeof(cmd)) {
-            usleep(STABILIZE_DELAY_US);
-            int bytes_read = read_with_timeout(fd, response, sizeof(response), READ_TIMEOUT_US);
-            if (bytes_read == 2 && response[0] == STK_INSYNC && response[1] == STK_OK) {
-                return 1;
-            }
-        }
-        usleep(STABILIZE_DELAY_US);
-    }
-    return 0;
+static void gang_progress(const stk500_progress_t *progress) {
+    gang_stage(progress->stage, progress->done, progress->total);
+    pthread_mutex_lock(&gang_lock);
+    gang_current->eta_s = progress->eta_s;
+    pthread_mutex_unlock(&gang_lock);
 }
 
-int get_programmer_version(int fd) {
-    unsigned char cmd[] = {'1', CRC_EOP};
-    unsigned char response[7];  // STK_INSYNC + "AVR ISP" + STK_OK
-    
-    if (write(fd, cmd, sizeof(cmd)) != sizeof(cmd)) {
-        return 0;
-    }
-    
-    usleep(STABILIZE_DELAY_US);
-    
-    int bytes_read = read_with_timeout(fd, response, sizeof(response), READ_TIMEOUT_US);
-    return (bytes_read >= 2 && response[0] == STK_INSYNC);
+static void gang_message(const char *text) {
+    pthread_mutex_lock(&gang_lock);
+    snprintf(gang_current->message, sizeof(gang_current->message), "%s", text);
+    pthread_mutex_unlock(&gang_lock);
 }
 
-int check_arduinoisp(int fd) {
-    if (!sync_programmer(fd)) {  // Changed from sync_with_programmer to sync_programmer
-        return 0;
+// One independent session per programmer; the image is shared read-only
+static void *gang_worker(void *arg) {
+    gang_slot_t *slot = arg;
+    const gang_job_t *job = slot->job;
+    gang_current = slot;
+    stk500.window = job->window;
+    stk500.listen(STK500_MESSAGE, gang_message);
+    stk500.listen(STK500_PROGRESS, gang_progress);
+
+    gang_stage("CONNECT", 0, 0);
+    int ok = stk500.open(&slot->port, job->part_name);
+    if (ok && job->fuse_count) {
+        gang_stage("FUSES", 0, 0);
+        const char *failed = write_fuses(job->fuse_args, job->fuse_count);
+        if (failed) {
+            gang_message(failed);
+            ok = 0;
+        }
+    }
+    ok = ok && stk500.flash_image(job->image, job->mode, job->verify);
+    if (ok && job->eeprom_file) {
+        ok = stk500.eeprom(job->eeprom_file, job->verify);
+    }
+    ok = stk500.close(ok);
+    if (job->stats_json) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s.%d", job->stats_json, slot->index);
+        stk500.dump(path);
     }
-    return get_programmer_version(fd);
-}
-
-int set_device_parameters(int fd) {
-    // ATtiny85 programming parameters
-    unsigned char set_device_cmd[] = {
-        STK_SET_DEVICE, 
-        0x14,  // device descriptor length
-        0x42,  // ATTINY85 device code
-        0x86,  // revision
-        0x00,  // prog type
-        0x01,  // parallelmode
-        0x01,  // polling
-        0x01,  // self-timed
-        0x01,  // lock bytes
-        0x03,  // fuse bytes
-        0xFF,  // flash poll value 1
-        0xFF,  // flash poll value 2
-        0x00,  // eeprom poll value 1
-        0xFF,  // eeprom poll value 2
-        0xFF,  // page size
-        0x00,  // eeprom page size
-        0x00, 0x80,  // flash size
-        0x00, 0x04,  // eeprom size
-        CRC_EOP
-    };
-    
-    unsigned char response[2];
-    return send_command(fd, set_device_cmd, sizeof(set_device_cmd), response, sizeof(response));
-}
-
-int wait_for_response(int fd) {
-    unsigned char response[2];
-    int bytes_read = read_with_timeout(fd, response, 2, READ_TIMEOUT_US);
-    return (bytes_read == 2 && response[0] == STK_INSYNC && response[1] == STK_OK);
-}
-
-int enter_program_mode(int fd) {
-    unsigned char cmd[] = {STK_ENTER_PROGMODE, CRC_EOP};
-    unsigned char response[2];
-    return send_command(fd, cmd, sizeof(cmd), response, sizeof(response));
-}
-
-int leave_program_mode(int fd) {
-    unsigned char cmd[] = {STK_LEAVE_PROGMODE, CRC_EOP};
-    unsigned char response[2];
-    return send_command(fd, cmd, sizeof(cmd), response, sizeof(response));
-}
-
-int universal_command(int fd, unsigned char cmd0, unsigned char cmd1, unsigned char cmd2, unsigned char cmd3) {
-    unsigned char cmd[] = {STK_UNIVERSAL, cmd0, cmd1, cmd2, cmd3, CRC_EOP};
-    unsigned char response[3];
-    return send_command(fd, cmd, sizeof(cmd), response, sizeof(response));
-}
 
-int check_signature(int fd) {
-    unsigned char sig0, sig1, sig2;
-    
-    // Read signature bytes
-    universal_command(fd, 0x30, 0x00, 0x00, 0x00);
-    universal_command(fd, 0x30, 0x00, 0x01, 0x00);
-    universal_command(fd, 0x30, 0x00, 0x02, 0x00);
-    
-    return (sig0 == ATTINY85_SIGNATURE_0 &&
-            sig1 == ATTINY85_SIGNATURE_1 &&
-            sig2 == ATTINY85_SIGNATURE_2);
+    pthread_mutex_lock(&gang_lock);
+    slot->stage = ok ? "PASS" : "FAIL";
+    slot->end_us = serial.now();
+    slot->result = ok;
+    pthread_mutex_unlock(&gang_lock);
+    return NULL;
 }
 
-int load_address(int fd, unsigned int addr) {
-    unsigned char cmd[] = {
-        STK_LOAD_ADDRESS,
-        (unsigned char)(addr & 0xFF),
-        (unsigned char)((addr >> 8) & 0xFF),
-        CRC_EOP
-    };
-    unsigned char response[2];
-    return send_command(fd, cmd, sizeof(cmd), response, sizeof(response));
+static void gang_draw(gang_slot_t *slots, int count, int redraw) {
+    if (redraw) printf("\033[%dA", count);
+    long long now = serial.now();
+    pthread_mutex_lock(&gang_lock);
+    for (int i = 0; i < count; i++) {
+        gang_slot_t *slot = &slots[i];
+        long long end = slot->result < 0 ? now : slot->end_us;
+        char pages[24] = "", eta[16] = "";
+        if (slot->total > 0) snprintf(pages, sizeof(pages), "%d/%d", slot->done, slot->total);
+        if (slot->result < 0 && slot->eta_s >= 0) snprintf(eta, sizeof(eta), "eta %.0fs", slot->eta_s);
+        printf("\033[K  %-24s %-8s %-10s %-8s %6.1fs  %s\n", slot->port.name, slot->stage, pages, eta,
+               (end - slot->start_us) / 1e6, slot->message);
+    }
+    pthread_mutex_unlock(&gang_lock);
+    fflush(stdout);
 }
 
-int program_page(int fd, Page *page) {
-    unsigned char cmd[PAGE_SIZE + 5];
-    cmd[0] = STK_PROG_FLASH;
-    cmd[1] = (page->length >> 8) & 0xFF;
-    cmd[2] = page->length & 0xFF;
-    cmd[3] = 'F';  // Flash memory
-    memcpy(&cmd[4], page->data, page->length);
-    cmd[page->length + 4] = CRC_EOP;
+// Programs the same image through every programmer found, all at once. Each port gets
+// its own thread and session, so the wall time stays close to that of a single board.
+static int gang_upload(const char *filename, gang_job_t *job, unsigned int vid, unsigned int pid) {
+    static stk500_port_t ports[STK500_MAX_PORTS];
+    static gang_slot_t slots[STK500_MAX_PORTS];
+    int count = stk500.ports(ports, vid, pid);
+    if (count == 0) {
+        printf("No serial ports found\n");
+        return 0;
+    }
 
-    unsigned char response[2];
-    return send_command(fd, cmd, page->length + 5, response, sizeof(response));
-}
+    stk500_image_t *image = malloc(sizeof(stk500_image_t));
+    if (image == NULL || !stk500.load(filename, image)) {
+        free(image);
+        return 0;
+    }
+    job->image = image;
+    device.open(NULL);  // the device table is loaded lazily, which is not thread-safe
+
+    printf("Gang upload of %s to %d port%s\n", filename, count, count == 1 ? "" : "s");
+    long long start = serial.now();
+    for (int i = 0; i < count; i++) {
+        slots[i] = (gang_slot_t){ .index = i, .port = ports[i], .job = job, .stage = "START", .eta_s = -1, .start_us = start, .result = -1 };
+        slots[i].started = pthread_create(&slots[i].thread, NULL, gang_worker, &slots[i]) == 0;
+        if (!slots[i].started) {
+            slots[i].stage = "FAIL";
+            slots[i].end_us = start;
+            slots[i].result = 0;
+            snprintf(slots[i].message, sizeof(slots[i].message), "no thread");
+        }
+    }
 
-int hex_char_to_int(char c) {
-    if (c >= '0' && c <= '9') return c - '0';
-    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-    return -1;
-}
+    gang_draw(slots, count, 0);
+    for (int running = 1; running; ) {
+        usleep(GANG_REFRESH_US);
+        running = 0;
+        pthread_mutex_lock(&gang_lock);
+        for (int i = 0; i < count; i++) running |= slots[i].result < 0;
+        pthread_mutex_unlock(&gang_lock);
+        gang_draw(slots, count, 1);
+    }
+    for (int i = 0; i < count; i++) {
+        if (slots[i].started) pthread_join(slots[i].thread, NULL);
+    }
 
-int parse_hex_byte(const char *str) {
-    int high = hex_char_to_int(str[0]);
-    int low = hex_char_to_int(str[1]);
-    if (high < 0 || low < 0) return -1;
-    return (high << 4) | low;
+    int passed = 0;
+    long long busy = 0;
+    for (int i = 0; i < count; i++) {
+        passed += slots[i].result;
+        busy += slots[i].end_us - slots[i].start_us;
+    }
+    double wall = (serial.now() - start) / 1e6;
+    printf("\n%d of %d passed in %.1f s (%.1f s of sessions, %.1fx)\n", passed, count, wall, busy / 1e6,
+           wall > 0 ? busy / 1e6 / wall : 0.0);
+    for (int i = 0; i < count; i++) {
+        printf("  %-24s %s  %6.1f s%s%s\n", slots[i].port.name, slots[i].result ? "PASS" : "FAIL",
+               (slots[i].end_us - slots[i].start_us) / 1e6, slots[i].result ? "" : "  ", slots[i].result ? "" : slots[i].message);
+    }
+    free(image);
+    return passed == count;
 }
 
-int process_hex_line(const char *line, Page *current_page, unsigned int *base_addr) {
-    if (line[0] != ':') return 0;
-    
-    int length = parse_hex_byte(line + 1);
-    if (length < 0) return 0;
-    
-    int addr = (parse_hex_byte(line + 3) << 8) | parse_hex_byte(line + 5);
-    int record_type = parse_hex_byte(line + 7);
-    
-    switch (record_type) {
-        case DATA_RECORD: {
-            unsigned int full_addr = (*base_addr | addr) / 2;  // Convert byte address to word address
-            
-            if (current_page->length == 0) {
-                current_page->address = full_addr;
-            }
-            
-            for (int i = 0; i < length; i++) {
-                int byte = parse_hex_byte(line + 9 + (i * 2));
-                if (byte < 0) return 0;
-                current_page->data[current_page->length++] = byte;
-                
-                if (current_page->length >= PAGE_SIZE) {
-                    return 2;  // Page full
-                }
-            }
-            return 1;
-        }
-        
-        case EXT_LINEAR_ADDR: {
-            *base_addr = (parse_hex_byte(line + 9) << 24) | (parse_hex_byte(line + 11) << 16);
-            return 1;
+int main(int argc, char *argv[]) {
+    const char *filename = "blink.hex";
+    const char *part_name = STK500_DEFAULT_PART;
+    stk500_mode_t mode = STK500_FULL;
+    int verify = 1;
+    unsigned int filter_vid = 0, filter_pid = 0;
+    int wait_ms = 0;
+    int rescan = 0;
+    int gang = 0;
+    int stats = 0;
+    const char *stats_json = NULL;
+    const char *action = NULL;     // "read" or "restore" of `memory`, to or from `filename`
+    const char *memory = NULL;
+    const char *eeprom_file = NULL;
+    stk500_port_t port = {0};
+    const char *fuse_args[MAX_FUSE_ARGS];
+    int fuse_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-verify") == 0) {
+            verify = 0;
+        } else if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--part") == 0) && i + 1 < argc) {
+            part_name = argv[++i];
+        } else if (strcmp(argv[i], "--fuse") == 0 && i + 1 < argc && fuse_count < MAX_FUSE_ARGS) {
+            fuse_args[fuse_count++] = argv[++i];  // name=value, e.g. lfuse=0xE2
+        } else if (strcmp(argv[i], "--rescan") == 0) {
+            rescan = 1;
+        } else if (strcmp(argv[i], "--id") == 0 && i + 1 < argc) {
+            sscanf(argv[++i], "%x:%x", &filter_vid, &filter_pid);
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            snprintf(port.name, sizeof(port.name), "%s", argv[++i]);  // e.g. the pty of sim.c
+        } else if (strcmp(argv[i], "--eeprom") == 0 && i + 1 < argc) {
+            eeprom_file = argv[++i];  // HEX of the .eeprom section, written after flash
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_json = argv[++i];
+        } else if ((strcmp(argv[i], "read") == 0 || strcmp(argv[i], "restore") == 0) && i + 2 < argc) {
+            action = argv[i];
+            memory = argv[++i];
+            filename = argv[++i];
+        } else if (strcmp(argv[i], "--gang") == 0) {
+            gang = 1;
+        } else if (strcmp(argv[i], "--wait") == 0 && i + 1 < argc) {
+            wait_ms = atoi(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--diff") == 0) {
+            mode = STK500_DIFF;
+        } else if (strcmp(argv[i], "--cached") == 0) {
+            mode = STK500_CACHED;
+        } else if ((strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--window") == 0) && i + 1 < argc) {
+            stk500.window = atoi(argv[++i]);
+            if (stk500.window < 1) stk500.window = 1;
+            if (stk500.window > STK500_MAX_WINDOW) stk500.window = STK500_MAX_WINDOW;
+        } else {
+            filename = argv[i];
         }
-        
-        case END_OF_FILE:
-            return current_page->length > 0 ? 2 : 1;
-            
-        default:
-            return 1;  // Skip other record types
     }
-}
 
-int upload_hex_file(int fd, const char *filename) {
-    if (!sync_programmer(fd)) {
-        printf("Failed to sync with programmer\n");
-        return 0;
+    if (action && memory_type(memory) == 0) {
+        printf("Unknown memory %s; use flash, eeprom or fuses\n", memory);
+        return 1;
     }
-    
-    if (!set_device_parameters(fd)) {
-        printf("Failed to set device parameters\n");
-        return 0;
+    if (action && gang) {
+        printf("%s works on one programmer; leave out --gang\n", action);
+        return 1;
     }
-    
-    if (!enter_program_mode(fd)) {
-        printf("Failed to enter programming mode\n");
-        return 0;
-    }
-    
-    if (!check_signature(fd)) {
-        printf("Device signature mismatch - expected ATtiny85\n");
-        leave_program_mode(fd);
-        return 0;
-    }
-    
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        printf("Failed to open hex file: %s\n", strerror(errno));
-        leave_program_mode(fd);
-        return 0;
+
+    if (gang) {
+        gang_job_t job = { .part_name = part_name, .fuse_args = fuse_args, .fuse_count = fuse_count,
+                           .eeprom_file = eeprom_file, .stats_json = stats_json, .mode = mode, .verify = verify, .window = stk500.window };
+        return gang_upload(filename, &job, filter_vid, filter_pid) ? 0 : 1;
     }
-    
-    char line[HEX_LINE_LENGTH];
-    Page current_page = {0};
-    unsigned int base_addr = 0;
-    int total_bytes = 0;
-    
-    // [Rest of the hex file processing remains the same]
-    while (fgets(line, sizeof(line), fp)) {
-        char *newline = strchr(line, '\n');
-        if (newline) *newline = 0;
-        newline = strchr(line, '\r');
-        if (newline) *newline = 0;
-        
-        int result = process_hex_line(line, &current_page, &base_addr);
-        if (!result) {
-            printf("Error processing hex file line: %s\n", line);
-            fclose(fp);
-            leave_program_mode(fd);
-            return 0;
+
+    int ok = port.name[0] ? stk500.open(&port, part_name)
+                          : stk500.connect(part_name, filter_vid, filter_pid, rescan, wait_ms);
+    if (ok && action) {
+        ok = strcmp(action, "read") == 0 ? backup(memory, filename) : restore(memory, filename, mode, verify);
+    } else if (ok) {
+        // Fuses go first, in the same session; unchanged ones are only read
+        const char *failed = write_fuses(fuse_args, fuse_count);
+        if (failed) {
+            printf("Fuse %s failed\n", failed);
+            ok = 0;
+        }
+        if (ok) {
+            printf("Attempting to upload %s using STK500v1 protocol (window %d)...\n", filename, stk500.window);
+            ok = stk500.flash(filename, mode, verify);
         }
-        
-        if (result == 2 || feof(fp)) {
-            if (!load_address(fd, current_page.address)) {
-                printf("Failed to load address 0x%04X\n", current_page.address);
-                fclose(fp);
-                leave_program_mode(fd);
-                return 0;
-            }
-            
-            if (!program_page(fd, &current_page)) {
-                printf("Failed to program page at address 0x%04X\n", current_page.address);
-                fclose(fp);
-                leave_program_mode(fd);
-                return 0;
-            }
-            
-            total_bytes += current_page.length;
-            printf("Programmed %d bytes at address 0x%04X\n", current_page.length, current_page.address);
-            
-            current_page.length = 0;
+        if (ok && eeprom_file) {
+            ok = stk500.eeprom(eeprom_file, verify);
         }
     }
-    
-    printf("Successfully programmed %d bytes total\n", total_bytes);
-    fclose(fp);
-    return leave_program_mode(fd);
-}
+    ok = stk500.close(ok);
 
-int main() {
-    char ports[MAX_PORTS][PORT_NAME_LENGTH];
-    int port_count = get_available_ports(ports);
-    
-    printf("Found %d potential serial ports\n", port_count);
-    
-    for (int i = 0; i < port_count; i++) {
-        printf("\nTrying port %s...\n", ports[i]);
-        
-        int fd = open_port(ports[i]);
-        if (fd < 0) {
-            printf("Failed to open %s: %s\n", ports[i], strerror(errno));
-            continue;
-        }
-        
-        printf("Opened %s successfully\n", ports[i]);
-        usleep(INIT_DELAY_US);
-        
-        printf("Attempting to upload blink.hex using STK500v1 protocol...\n");
-        if (upload_hex_file(fd, "blink.hex")) {
-            printf("Upload completed successfully!\n");
-            close(fd);
-            return 0;
-        } else {
-            printf("Upload failed\n");
-            close(fd);
-        }
+    // Telemetry covers failed sessions too; those are the ones worth a look
+    if (stats) stk500.report();
+    if (stats_json && !stk500.dump(stats_json)) printf("Cannot write %s\n", stats_json);
+
+    if (action) {
+        printf("%s %s %s\n", action, memory, ok ? "done" : "failed");
+    } else {
+        printf(ok ? "Upload completed successfully!\n" : "Upload failed\n");
     }
-    
-    printf("\nFailed to upload hex file on any port\n");
-    return 1;
-}
\ No newline at end of file
+    return ok ? 0 : 1;
+}
@@ -1,11 +1,12 @@
 #include <stdio.h>
 #include <string.h>
-#include <fcntl.h>
 #include <errno.h>
-#include <termios.h>
 #include <unistd.h>
 #include <stdlib.h>
 
+#include "lib/hex.h"
+#include "lib/serial.h"
+
 #define STK_OK 0x10
 #define STK_FAILED 0x11
 #define STK_UNKNOWN 0x12
@@ -22,69 +23,25 @@
 #define STK_PROG_PAGE 0x64
 #define STK_LEAVE_PROGMODE 0x51
 
-int open_serial(const char *port) {
-    int fd = open(port, O_RDWR | O_NOCTTY);
-    if (fd < 0) {
-        fprintf(stderr, "Error opening %s: %s\n", port, strerror(errno));
-        return -1;
-    }
-
-    struct termios tty;
-    memset(&tty, 0, sizeof(tty));
-
-    if (tcgetattr(fd, &tty) != 0) {
-        fprintf(stderr, "Error from tcgetattr: %s\n", strerror(errno));
-        close(fd);
-        return -1;
-    }
-
-    cfsetospeed(&tty, B115200);
-    cfsetispeed(&tty, B115200);
-
-    tty.c_cflag &= ~PARENB;
-    tty.c_cflag &= ~CSTOPB;
-    tty.c_cflag &= ~CSIZE;
-    tty.c_cflag |= CS8;
-    tty.c_cflag &= ~CRTSCTS;
-    tty.c_cflag |= CREAD | CLOCAL;
-
-    tty.c_lflag &= ~ICANON;
-    tty.c_lflag &= ~ECHO;
-    tty.c_lflag &= ~ECHOE;
-    tty.c_lflag &= ~ECHONL;
-    tty.c_lflag &= ~ISIG;
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
-    tty.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL);
-    tty.c_oflag &= ~OPOST;
-    tty.c_oflag &= ~ONLCR;
-
-    tty.c_cc[VTIME] = 10;  // 1 second timeout
-    tty.c_cc[VMIN] = 0;
-
-    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-        fprintf(stderr, "Error from tcsetattr: %s\n", strerror(errno));
-        close(fd);
-        return -1;
-    }
-
-    return fd;
-}
+#define ARDUINOISP_BAUD 19200
+#define RESPONSE_TIMEOUT_US 1000000
 
+// Sends command, payload and CRC_EOP as one frame, then waits for resp_len bytes
 int send_command(int fd, uint8_t cmd, uint8_t *data, int len, uint8_t *response, int resp_len) {
-    uint8_t sync_cmd[] = {cmd};
-    write(fd, sync_cmd, 1);
-    
-    if (data && len > 0) {
-        write(fd, data, len);
+    uint8_t eop = CRC_EOP;
+    serial_chunk_t frame[] = {
+        { &cmd, 1 },
+        { data, data ? len : 0 },
+        { &eop, 1 }
+    };
+    if (!serial.send(fd, frame, 3)) {
+        fprintf(stderr, "Error writing command 0x%02X: %s\n", cmd, strerror(errno));
+        return -1;
     }
-    
-    uint8_t eop[] = {CRC_EOP};
-    write(fd, eop, 1);
 
     if (response && resp_len > 0) {
-        int n = read(fd, response, resp_len);
-        if (n != resp_len) {
-            fprintf(stderr, "Error: Expected %d bytes, got %d\n", resp_len, n);
+        if (!serial.read_exact(fd, response, resp_len, serial.now() + RESPONSE_TIMEOUT_US)) {
+            fprintf(stderr, "Error: Expected %d bytes in reply to 0x%02X\n", resp_len, cmd);
             return -1;
         }
     }
@@ -98,8 +55,11 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    int fd = open_serial(argv[1]);
-    if (fd < 0) return 1;
+    int fd = serial.open(argv[1], ARDUINOISP_BAUD);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
 
     printf("Synchronizing...\n");
     uint8_t response[2];
@@ -134,7 +94,7 @@ int main(int argc, char *argv[]) {
         0xFF, // eeprompollval1
         0xFF, // eeprompollval2
         0x00, // pagesizehigh
-        0x20, // pagesizelow (32 bytes page size for ATtiny85)
+        0x40, // pagesizelow (64 bytes page size for ATtiny85)
         0x00, // eepromsizehigh
         0x80, // eepromsizelow (512 bytes EEPROM)
         0x00, // flashsize4
@@ -156,56 +116,45 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    FILE *hex_file = fopen(argv[2], "rb");
-    if (!hex_file) {
-        fprintf(stderr, "Error opening hex file: %s\n", strerror(errno));
+    static hex_image_t image;
+    if (hex.load(argv[2], &image) != 0) {
+        fprintf(stderr, "Error loading hex file: %s\n", hex.error());
         close(fd);
         return 1;
     }
 
-    char line[256];
-    uint16_t address = 0;
-    uint8_t page_buffer[32];  // ATtiny85 has 32-byte pages
-    int page_size = 32;       // ATtiny85 page size
+    int page_size = 64;       // ATtiny85 page size in bytes
     
     printf("Programming flash...\n");
-    while (fgets(line, sizeof(line), hex_file)) {
-        if (line[0] != ':') continue;
+    for (unsigned int addr = 0; addr < image.top; addr += page_size) {
+        int blank = 1;
+        for (int i = 0; i < page_size; i++) {
+            if (image.data[addr + i] != 0xFF) blank = 0;
+        }
+        if (blank) continue;
+
+        unsigned int word = addr / 2;
+        uint8_t addr_data[] = {word & 0xFF, (word >> 8) & 0xFF};
+        if (send_command(fd, STK_LOAD_ADDRESS, addr_data, 2, response, 2) < 0) {
+            fprintf(stderr, "Failed to set address\n");
+            break;
+        }
         
-        int len, addr, type;
-        sscanf(line + 1, "%02x%04x%02x", &len, &addr, &type);
+        uint8_t prog_data[page_size + 3];
+        prog_data[0] = (page_size >> 8) & 0xFF;
+        prog_data[1] = page_size & 0xFF;
+        prog_data[2] = 'F';
+        memcpy(prog_data + 3, image.data + addr, page_size);
         
-        if (type == 0) {
-            uint8_t addr_data[] = {addr & 0xFF, (addr >> 8) & 0xFF};
-            if (send_command(fd, STK_LOAD_ADDRESS, addr_data, 2, response, 2) < 0) {
-                fprintf(stderr, "Failed to set address\n");
-                break;
-            }
-            
-            uint8_t prog_data[page_size + 4];
-            prog_data[0] = 0x00;
-            prog_data[1] = (page_size >> 8) & 0xFF;
-            prog_data[2] = page_size & 0xFF;
-            prog_data[3] = 'F';
-            
-            for (int i = 0; i < len; i++) {
-                int byte;
-                sscanf(line + 9 + (i * 2), "%02x", &byte);
-                prog_data[4 + i] = byte;
-            }
-            
-            if (send_command(fd, STK_PROG_PAGE, prog_data, len + 4, response, 2) < 0) {
-                fprintf(stderr, "Failed to program page\n");
-                break;
-            }
-            
-            printf(".");
-            fflush(stdout);
+        if (send_command(fd, STK_PROG_PAGE, prog_data, page_size + 3, response, 2) < 0) {
+            fprintf(stderr, "Failed to program page\n");
+            break;
         }
+        
+        printf(".");
+        fflush(stdout);
     }
     printf("\nProgramming complete!\n");
-    
-    fclose(hex_file);
 
     printf("Leaving programming mode...\n");
     if (send_command(fd, STK_LEAVE_PROGMODE, NULL, 0, response, 2) < 0) {